@@ -0,0 +1,650 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <unordered_map>
+#include <sys/resource.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "./shunting-yard.h"
+#include "./script.h"
+
+// Micro benchmarks for the parser:
+//
+// 1. A subclassed calculator that copies its Config_t on
+//    every compile() and eval() against one that doesn't.
+// 2. Compiling against a large variable by value and by reference.
+// 3. Key lookups on std::map against the TokenMap_t hash table,
+//    by string and by atom.
+// 4. Scope chain lookups by chain depth.
+// 5. Copying and slicing lists element by element against
+//    copy-on-write and slice views.
+// 6. Numeric operations on lists against numeric arrays.
+// 7. Building a string with `s = s + x` in a loop, and reading
+//    a long string with shared and copied payloads.
+// 8. Collecting maps and lists left in reference cycles.
+// 9. Memory and attribute access of small maps with
+//    shared shapes against maps with their own hash table.
+// 10. Lazy iterator pipelines against materialized lists.
+// 11. Evaluating on host records of 200 fields, copying the
+//     fields into a map against resolving the ones used.
+// 12. Filling lists and maps from C++ containers item by item
+//     against the bulk constructors.
+// 13. Loading a large file of newline separated rules with script.
+//
+// Usage: ./bench-shunting-yard [iterations] [script size in MB]
+
+struct benchCalc : public calculator {
+  static Config_t& my_config() {
+    static Config_t conf = calculator::Default();
+    return conf;
+  }
+
+  const Config_t& Config() const { return my_config(); }
+
+  using calculator::calculator;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed_ms(bench_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - start).count();
+}
+
+// Peak resident memory of this process in MB:
+double peak_rss_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+// Peak resident memory in MB since the last call with reset = true.
+// Resetting it needs Linux, elsewhere this is the peak of the process:
+double peak_rss_since_mb(bool reset) {
+  if (reset) {
+#ifdef __GLIBC__
+    // Return the free heap, so it isn't reused unnoticed:
+    malloc_trim(0);
+#endif
+    std::ofstream("/proc/self/clear_refs") << "5";
+  }
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) return atof(line.c_str() + 6) / 1024;
+  }
+  return peak_rss_mb();
+}
+
+const Config_t& by_reference_config() {
+  static Config_t config = calculator::Default();
+  config.bindMode = BIND_BY_REFERENCE;
+  return config;
+}
+
+void bench_binding(int iterations) {
+  TokenMap vars;
+  vars["text"] = std::string(1 << 20, 'x');
+  const char* expr = "text + 'y'";
+
+  const Config_t& by_reference = by_reference_config();
+
+  int n = iterations / 100 + 1;
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    calculator c(expr, vars);
+  }
+  double by_value_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    calculator c(expr, vars, 0, 0, by_reference);
+  }
+  double by_reference_ms = elapsed_ms(start);
+
+  printf("compiling against a 1 MB string, %d times:\n", n);
+  printf("bind by value:    %10.2f ms\n", by_value_ms);
+  printf("bind by ref:      %10.2f ms\n", by_reference_ms);
+}
+
+void bench_lookup(int iterations) {
+  std::vector<std::string> keys;
+  std::vector<atom_t> atoms;
+  for (int i = 0; i < 1000; ++i) {
+    keys.push_back("attribute_" + std::to_string(i));
+    atoms.push_back(atom_t(keys.back()));
+  }
+
+  // Before: the TokenMap storage was a std::map.
+  std::map<std::string, packToken> tree;
+  TokenMap_t table;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    tree[keys[i]] = packToken(static_cast<int64_t>(i));
+    table[keys[i]] = packToken(static_cast<int64_t>(i));
+  }
+
+  int64_t sum = 0;
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    sum += tree.find(keys[i % keys.size()])->second.asInt();
+  }
+  double tree_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    sum -= table.find(keys[i % keys.size()])->second.asInt();
+  }
+  double table_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    sum += table.find(atoms[i % atoms.size()])->second.asInt();
+  }
+  for (int i = 0; i < iterations; ++i) {
+    sum -= table.find(atoms[i % atoms.size()])->second.asInt();
+  }
+  double atom_ms = elapsed_ms(start) / 2;
+
+  printf("%d lookups on 1000 keys (%s):\n", iterations, sum ? "error" : "ok");
+  printf("std::map:         %10.2f ms\n", tree_ms);
+  printf("TokenMap_t:       %10.2f ms\n", table_ms);
+  printf("TokenMap_t atoms: %10.2f ms\n", atom_ms);
+}
+
+void bench_scope_chain(int iterations) {
+  const char* name = "builtin_name";
+  atom_t atom(name), missing("missing_name");
+
+  TokenMap root;
+  for (int i = 0; i < 20; ++i) root["key_" + std::to_string(i)] = i;
+  root[name] = 1;
+
+  printf("scope chain lookups, %d times:\n", iterations);
+  printf("depth     by string     by atom     misses\n");
+  TokenMap leaf = root;
+  for (int depth = 0; depth <= 10; ++depth) {
+    if (depth == 1 || depth == 2 || depth == 5 || depth == 10) {
+      int64_t sum = 0;
+      bench_clock::time_point start = bench_clock::now();
+      for (int i = 0; i < iterations; ++i) sum += leaf.find(name)->asInt();
+      double by_string = elapsed_ms(start);
+
+      start = bench_clock::now();
+      for (int i = 0; i < iterations; ++i) sum += leaf.find(atom)->asInt();
+      double by_atom = elapsed_ms(start);
+
+      start = bench_clock::now();
+      for (int i = 0; i < iterations; ++i) sum += leaf.find(missing) != 0;
+      double misses = elapsed_ms(start);
+
+      printf("%5d %10.2f ms %8.2f ms %8.2f ms%s\n", depth, by_string,
+             by_atom, misses, sum == 2 * iterations ? "" : " (error)");
+    }
+    leaf = leaf.getChild();
+  }
+
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    TokenMap child = root.getChild();
+  }
+  printf("child scopes:     %10.2f ms\n", elapsed_ms(start));
+}
+
+void bench_list_copy(int iterations) {
+  TokenMap vars;
+  TokenList items;
+  for (int i = 0; i < 10000; ++i) items.push(i);
+  vars["items"] = items;
+
+  // Before: list() and `+` copied every item.
+  int n = iterations / 100 + 1;
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    TokenList copy;
+    for (const packToken& item : items.items()) copy.list().push_back(item);
+  }
+  double by_item = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    TokenList copy = items.copy();
+  }
+  double shared = elapsed_ms(start);
+
+  calculator c("sum(list(items) + [])", vars);
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) c.eval(vars);
+  double script = elapsed_ms(start);
+
+  // Before: sublists were built item by item.
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    TokenList sublist;
+    for (size_t j = 1000; j < 9000; ++j) sublist.push(items.at(j));
+  }
+  double sublist_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    TokenList sublist = items.slice(1000, 8000);
+  }
+  double slice_ms = elapsed_ms(start);
+
+  printf("copying a list of 10000 items, %d times:\n", n);
+  printf("item by item:     %10.2f ms\n", by_item);
+  printf("copy-on-write:    %10.2f ms\n", shared);
+  printf("sum(list(L)+[]):  %10.2f ms\n", script);
+  printf("sublist of 8000:  %10.2f ms\n", sublist_ms);
+  printf("slice view:       %10.2f ms\n", slice_ms);
+}
+
+void bench_num_array(int iterations) {
+  TokenList list;
+  for (int i = 0; i < 1000000; ++i) list.push(i * 0.5);
+  NumArray array(list);
+
+  TokenMap vars;
+  vars["L"] = list;
+  vars["A"] = array;
+
+  int n = iterations / 1000 + 1;
+  calculator list_sum("sum(L)", vars, 0, 0, by_reference_config());
+  calculator array_sum("sum(A)", vars, 0, 0, by_reference_config());
+  calculator array_ops("A * 2 + A", vars, 0, 0, by_reference_config());
+
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < n; ++i) list_sum.eval();
+  double list_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) array_sum.eval();
+  double array_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) array_ops.eval();
+  double ops_ms = elapsed_ms(start);
+
+  printf("1M numbers, %d times:\n", n);
+  printf("sum(list):        %10.2f ms\n", list_ms);
+  printf("sum(array):       %10.2f ms\n", array_ms);
+  printf("array * 2 + array:%10.2f ms\n", ops_ms);
+}
+
+void bench_string_building(int iterations) {
+  TokenMap vars;
+  vars["x"] = "some text, ";
+  vars["s"] = "";
+
+  // Before: each `+` copied the whole left operand.
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    vars["s"] = vars["s"].asString() + vars["x"].asString();
+  }
+  double copying = elapsed_ms(start);
+
+  vars["s"] = "";
+  calculator append("s = s + x");
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) append.eval(vars);
+  size_t size = vars["s"].asString().size();
+  double building = elapsed_ms(start);
+
+  printf("s = s + x, %d times (%zu KB):\n", iterations, size >> 10);
+  printf("copying strings:  %10.2f ms\n", copying);
+  printf("string builder:   %10.2f ms\n", building);
+
+  // Before: every clone of a string token copied it.
+  vars["t"] = std::string(64 << 10, 'x');
+  calculator read("t == t");
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    packToken left(std::string(vars["t"].asConstString()));
+    packToken right(std::string(vars["t"].asConstString()));
+    if (left != right) return;
+  }
+  double copies = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) read.eval(vars);
+  double shared = elapsed_ms(start);
+
+  printf("t == t on 64 KB, %d times:\n", iterations);
+  printf("copied strings:   %10.2f ms\n", copies);
+  printf("shared strings:   %10.2f ms\n", shared);
+}
+
+void bench_cycles(int iterations) {
+  CycleCollector::enable();
+  CycleCollector::collect();
+
+  // Before: these were never freed.
+  for (int i = 0; i < iterations; ++i) {
+    TokenMap node;
+    node["self"] = node;
+    node["items"] = TokenList();
+    node["items"].asList().push(node);
+    node["items"].asList().push(i);
+  }
+
+  bench_clock::time_point start = bench_clock::now();
+  CycleCollector::result_t result = CycleCollector::collect();
+  double elapsed = elapsed_ms(start);
+
+  printf("%d maps in reference cycles:\n", iterations);
+  printf("collect:          %10.2f ms (%zu containers, %zu KB)\n",
+         elapsed, result.containers, result.bytes >> 10);
+  CycleCollector::enable(false);
+}
+
+void bench_shapes(int iterations) {
+  int n = iterations * 5;
+  std::vector<TokenMap> shaped, tables;
+  shaped.reserve(n);
+  tables.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    TokenMap p;
+    p["x"] = i;
+    p["y"] = 1;
+    p["id"] = i;
+    shaped.push_back(p);
+
+    // Before: every map had a hash table of its own.
+    TokenMap q;
+    q["x"] = i;
+    q["y"] = 1;
+    q["tmp"] = 0;
+    q.erase("tmp");
+    q["id"] = i;
+    tables.push_back(q);
+  }
+
+  size_t shaped_bytes = 0, table_bytes = 0;
+  for (int i = 0; i < n; ++i) {
+    shaped_bytes += shaped[i].map().memory();
+    table_bytes += tables[i].map().memory();
+  }
+
+  atom_t keys[] = {atom_t("x"), atom_t("y"), atom_t("id")};
+  int64_t sum = 0;
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    for (const atom_t& key : keys) sum += tables[i].map().find(key)->second.asInt();
+  }
+  double table_find = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    for (const atom_t& key : keys) sum -= shaped[i].map().find(key)->second.asInt();
+  }
+  double shaped_find = elapsed_ms(start);
+
+  calculator c("p.x + p['y'] + p.id");
+  TokenMap vars;
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    vars["p"] = tables[i];
+    sum += c.eval(vars).asInt();
+  }
+  double table_eval = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < n; ++i) {
+    vars["p"] = shaped[i];
+    sum -= c.eval(vars).asInt();
+  }
+  double shaped_eval = elapsed_ms(start);
+
+  size_t data = sizeof(MapData_t);
+  printf("%d maps with 3 keys, reading each key and evaluating "
+         "p.x + p['y'] + p.id (%s):\n", n, sum ? "error" : "ok");
+  printf("hash tables:      %10.2f ms %10.2f ms (%zu bytes per map)\n",
+         table_find, table_eval, data + table_bytes / n);
+  printf("shapes:           %10.2f ms %10.2f ms (%zu bytes per map)\n",
+         shaped_find, shaped_eval, data + shaped_bytes / n);
+}
+
+void bench_pipelines(int iterations) {
+  int n = iterations * 50;
+  TokenMap vars;
+  vars["n"] = n;
+
+  double rss_before = peak_rss_since_mb(true);
+  bench_clock::time_point start = bench_clock::now();
+  double lazy = calculator::calculate("sum(map(abs, filter(None, range(n))))",
+                                      vars).asDouble();
+  double lazy_ms = elapsed_ms(start);
+  double lazy_rss = peak_rss_since_mb(false) - rss_before;
+
+  // Before: each step of the pipeline built a list.
+  rss_before = peak_rss_since_mb(true);
+  start = bench_clock::now();
+  double listed = calculator::calculate(
+      "sum(list(map(abs, list(filter(None, list(range(n)))))))", vars).asDouble();
+  double listed_ms = elapsed_ms(start);
+  double listed_rss = peak_rss_since_mb(false) - rss_before;
+
+  printf("sum(map(abs, filter(None, range(%d)))) (%s):\n",
+         n, lazy == listed ? "ok" : "error");
+  printf("lists:            %10.2f ms (+%.2f MB)\n", listed_ms, listed_rss);
+  printf("lazy iterators:   %10.2f ms (+%.2f MB)\n", lazy_ms, lazy_rss);
+}
+
+// Reads the fields of the current record by name:
+struct recordResolver : public VariableResolver {
+  std::unordered_map<std::string, size_t> index;
+  const double* record = 0;
+
+  bool resolve(const std::string& name, packToken* value) {
+    auto it = index.find(name);
+    if (it == index.end()) return false;
+    *value = record[it->second];
+    return true;
+  }
+};
+
+void bench_resolver(int iterations) {
+  const size_t n_fields = 200;
+  std::vector<std::string> names;
+  std::vector<double> records(iterations * n_fields);
+  std::shared_ptr<recordResolver> resolver = std::make_shared<recordResolver>();
+  for (size_t i = 0; i < n_fields; ++i) {
+    names.push_back("field_" + std::to_string(i));
+    resolver->index[names.back()] = i;
+  }
+  for (size_t i = 0; i < records.size(); ++i) records[i] = i % 7;
+
+  calculator c("field_3 * field_50 + field_199");
+  double sum = 0;
+
+  // Before: every field was copied into the map.
+  bench_clock::time_point start = bench_clock::now();
+  for (int r = 0; r < iterations; ++r) {
+    TokenMap vars;
+    const double* record = &records[r * n_fields];
+    for (size_t i = 0; i < n_fields; ++i) vars[names[i]] = record[i];
+    sum += c.eval(vars).asDouble();
+  }
+  double copied_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int r = 0; r < iterations; ++r) {
+    TokenMap vars;
+    resolver->record = &records[r * n_fields];
+    vars.set_resolver(resolver);
+    sum -= c.eval(vars).asDouble();
+  }
+  double resolved_ms = elapsed_ms(start);
+
+  printf("%d records of %zu fields, evaluating 3 of them (%s):\n",
+         iterations, n_fields, sum ? "error" : "ok");
+  printf("copied fields:    %10.2f ms\n", copied_ms);
+  printf("resolver:         %10.2f ms\n", resolved_ms);
+}
+
+void bench_bulk(int iterations) {
+  int n = iterations * 50;
+  std::vector<double> values(n);
+  for (int i = 0; i < n; ++i) values[i] = i;
+
+  // Before: one push() per item.
+  bench_clock::time_point start = bench_clock::now();
+  {
+    TokenList list;
+    for (double value : values) list.push(value);
+  }
+  double pushed_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  {
+    TokenList list(values.begin(), values.end());
+  }
+  double range_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  {
+    std::vector<double> copy = values;
+    NumArray array(std::move(copy));
+  }
+  double array_ms = elapsed_ms(start);
+
+  std::vector<std::pair<std::string, double>> fields;
+  for (int i = 0; i < 200; ++i) fields.emplace_back("field_" + std::to_string(i), i);
+  int maps = iterations / 4 + 1;
+
+  start = bench_clock::now();
+  for (int i = 0; i < maps; ++i) {
+    TokenMap map;
+    for (const auto& field : fields) map[field.first] = field.second;
+  }
+  double assigned_ms = elapsed_ms(start);
+
+  start = bench_clock::now();
+  for (int i = 0; i < maps; ++i) {
+    TokenMap map;
+    map.reserve(fields.size());
+    map.insert(fields.begin(), fields.end());
+  }
+  double inserted_ms = elapsed_ms(start);
+
+  printf("%d doubles into a list:\n", n);
+  printf("push():           %10.2f ms\n", pushed_ms);
+  printf("range:            %10.2f ms\n", range_ms);
+  printf("array, moved:     %10.2f ms\n", array_ms);
+  printf("%d maps of %zu keys:\n", maps, fields.size());
+  printf("operator[]:       %10.2f ms\n", assigned_ms);
+  printf("reserve, insert:  %10.2f ms\n", inserted_ms);
+}
+
+void bench_script(size_t size_mb) {
+  const char* path = "bench-script.tmp";
+  size_t lines = 0;
+  {
+    std::ofstream file(path);
+    size_t written = 0;
+    while (written < size_mb << 20) {
+      std::string line = "rule" + std::to_string(lines++) +
+                         " = (a + 2) * b - a / 3 # rule\n";
+      file << line;
+      written += line.size();
+    }
+  }
+
+  TokenMap vars;
+  vars["a"] = 10;
+  vars["b"] = 3;
+
+  double rss_before = peak_rss_mb();
+  bench_clock::time_point start = bench_clock::now();
+  size_t statements;
+  std::string binary;
+  {
+    script rules;
+    rules.compile_file(path, vars);
+    statements = rules.size();
+    binary = rules.dump();
+  }
+  double elapsed = elapsed_ms(start);
+  double rss_after = peak_rss_mb();
+
+  start = bench_clock::now();
+  {
+    script rules;
+    rules.load(binary.data(), binary.size());
+  }
+  double loaded = elapsed_ms(start);
+
+  start = bench_clock::now();
+  {
+    script rules;
+    rules.compile_file(path, vars, "\n;", 0);
+  }
+  double parallel = elapsed_ms(start);
+  std::remove(path);
+
+  printf("script: %zu MB, %zu statements\n", size_mb, statements);
+  printf("load time:        %10.2f ms\n", elapsed);
+  printf("parallel load:    %10.2f ms (%u threads)\n",
+         parallel, std::thread::hardware_concurrency());
+  printf("binary load:      %10.2f ms (%zu KB)\n", loaded, binary.size() >> 10);
+  printf("peak memory:      %10.2f MB (+%.2f MB)\n",
+         rss_after, rss_after - rss_before);
+}
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  size_t script_mb = argc > 2 ? atoi(argv[2]) : 10;
+  const char* expr = "(a + 2) * b - a / 3 + (b % 5) ** 2";
+
+  TokenMap vars;
+  vars["a"] = 10;
+  vars["b"] = 3;
+
+  const Config_t& conf = benchCalc::my_config();
+  packToken result;
+
+  // Before: the config was copied by value on each parse and evaluation.
+  bench_clock::time_point start = bench_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    Config_t parse_copy = conf;
+    TokenQueue_t rpn = calculator::toRPN(expr, vars, 0, 0, parse_copy);
+    Config_t eval_copy = conf;
+    result = packToken(calculator::calculate(rpn, vars, eval_copy));
+    rpnBuilder::cleanRPN(&rpn);
+  }
+  double before = elapsed_ms(start);
+
+  // After: the config is only passed by reference.
+  start = bench_clock::now();
+  benchCalc c;
+  for (int i = 0; i < iterations; ++i) {
+    c.compile(expr, vars);
+    result = c.eval(vars);
+  }
+  double after = elapsed_ms(start);
+
+  printf("expression: %s = %s\n", expr, result.str().c_str());
+  printf("iterations: %d\n", iterations);
+  printf("copying Config_t: %10.2f ms\n", before);
+  printf("sharing Config_t: %10.2f ms\n", after);
+
+  bench_binding(iterations);
+  bench_lookup(iterations * 50);
+  bench_scope_chain(iterations * 50);
+  bench_list_copy(iterations);
+  bench_num_array(iterations);
+  bench_string_building(iterations);
+  bench_cycles(iterations);
+  bench_shapes(iterations);
+  bench_pipelines(iterations);
+  bench_resolver(iterations);
+  bench_bulk(iterations);
+  bench_script(script_mb);
+
+  return 0;
+}
@@ -1,4 +1,9 @@
+#include <new>
 #include <string>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <tuple>
 
 #include "./shunting-yard.h"
 
@@ -57,29 +62,72 @@ packToken TokenList::default_constructor(TokenMap scope) {
   // Get the arguments:
   TokenList list = scope["args"].asList();
 
+  // Lists share the items until one of them is written:
+  if (list.items().size() == 1 && list.items()[0]->type == LIST) {
+    return list.items()[0].asList().copy();
+  }
+
   // If the only argument is iterable:
-  if (list.list().size() == 1 && list.list()[0]->type & IT) {
+  if (list.items().size() == 1 && list.items()[0]->type & IT) {
     TokenList new_list;
-    Iterator* it = static_cast<Iterable*>(list.list()[0].token())->getIterator();
+    std::unique_ptr<Iterator> it(
+        static_cast<const Iterable*>(list.items()[0].token())->getIterator());
 
     packToken* next = it->next();
     while (next) {
+      evalBudget_t::count_bytes(sizeof(packToken));
       new_list.list().push_back(*next);
       next = it->next();
     }
 
-    delete it;
     return new_list;
   } else {
     return list;
   }
 }
 
+TokenList TokenList::copy() const {
+  TokenList result;
+  *result.ref = *ref;
+  return result;
+}
+
+TokenList TokenList::slice(size_t start, size_t count, int64_t step) const {
+  TokenList result;
+  result.set_slice(*this, start, count, step);
+  return result;
+}
+
+Tuple Tuple::slice(size_t start, size_t count, int64_t step) const {
+  Tuple result;
+  result.set_slice(*this, start, count, step);
+  return result;
+}
+
+void TokenList::set_slice(const TokenList& source, size_t start,
+                          size_t count, int64_t step) {
+  const ListData_t& data = *source.ref;
+  ref->items = data.items;
+  ref->is_view = true;
+  ref->count = count;
+  // Slices of slices are views over the original items:
+  ref->start = data.is_view ? data.start + int64_t(start) * data.step : start;
+  ref->step = data.is_view ? step * data.step : step;
+}
+
+void TokenList::materialize() const {
+  std::shared_ptr<TokenList_t> items = std::make_shared<TokenList_t>();
+  items->reserve(ref->count);
+  for (size_t i = 0; i < ref->count; ++i) items->push_back(ref->at(i));
+  ref->items = items;
+  ref->is_view = false;
+}
+
 /* * * * * TokenList iterator implemented functions * * * * */
 
 packToken* TokenList::ListIterator::next() {
-  if (i < list->size()) {
-    return &list->at(i++);
+  if (i < list.size()) {
+    return &list.at(i++);
   } else {
     i = 0;
     return NULL;
@@ -88,61 +136,601 @@ packToken* TokenList::ListIterator::next() {
 
 void TokenList::ListIterator::reset() { i = 0; }
 
-/* * * * * MapData_t struct: * * * * */
-MapData_t::MapData_t(){}
-MapData_t::MapData_t(TokenMap* p) : parent(p ? new TokenMap(*p) : 0) {}
-MapData_t::MapData_t(const MapData_t& other) {
-  map = other.map;
-  if (other.parent) {
-    parent = new TokenMap(*(other.parent));
+/* * * * * NumArray functions: * * * * */
+
+packToken NumArray::default_constructor(TokenMap scope) {
+  TokenList list = scope["args"].asList();
+
+  // Convert a single list or iterable argument:
+  if (list.items().size() == 1 && list.items()[0]->type == NUM_ARRAY) {
+    NumArray result;
+    result.array() = list.items()[0].asArray().array();
+    return result;
+  } else if (list.items().size() == 1 && list.items()[0]->type & IT) {
+    list = TokenList::default_constructor(scope).asList();
+  }
+
+  return NumArray(list);
+}
+
+NumArray::NumArray(const TokenList& list)
+                  : Container(std::make_shared<NumArray_t>(list.items().size())) {
+  this->type = NUM_ARRAY;
+  evalBudget_t::count_bytes(list.items().size() * sizeof(double));
+  double* out = array().data();
+  for (const packToken& item : list.items()) *out++ = item.asDouble();
+}
+
+TokenList NumArray::toList() const {
+  evalBudget_t::count_bytes(array().size() * sizeof(packToken));
+  TokenList result;
+  TokenList_t& items = result.list();
+  items.reserve(array().size());
+  for (double value : array()) items.push_back(value);
+  return result;
+}
+
+double NumArray::sum() const {
+  const double* values = array().data();
+  size_t size = array().size(), i = 0;
+
+  // Independent partial sums, so the compiler can use vector registers:
+  double lanes[4] = {0, 0, 0, 0};
+  for (; i + 4 <= size; i += 4) {
+    for (int k = 0; k < 4; ++k) lanes[k] += values[i + k];
+  }
+  for (; i < size; ++i) lanes[0] += values[i];
+
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+/* * * * * NumArray iterator implemented functions * * * * */
+
+packToken* NumArray::ArrayIterator::next() {
+  if (i < array->size()) {
+    last = (*array)[i++];
+    return &last;
   } else {
-    parent = 0;
+    i = 0;
+    return NULL;
   }
 }
-MapData_t::~MapData_t() { if (parent) delete parent; }
+
+void NumArray::ArrayIterator::reset() { i = 0; }
+
+/* * * * * MapData_t struct: * * * * */
+
+MapData_t::MapData_t(TokenMap* p)
+                    : gc_node_t(MAP_NODE),
+                      parent(p ? *p : TokenMap(TokenMap::null_t())) {
+  if (p) p->map().set_has_children();
+}
 
 MapData_t& MapData_t::operator=(const MapData_t& other) {
   if (this != &other) {
-    if (parent) delete parent;
     map = other.map;
     parent = other.parent;
+    resolver = other.resolver;
+    // The parent scopes changed:
+    TokenMap_t::invalidate_caches();
+  }
+  return *this;
+}
+
+/* * * * * atom_t Class: * * * * */
+
+atom_t::atom_t(const std::string& name) {
+  typedef std::unordered_map<std::string, data_t> atomTable_t;
+  // Never destroyed, so atoms stay valid during static destruction:
+  static atomTable_t& table = *new atomTable_t();
+  static std::mutex mutex;
+
+  // References to the items of an unordered_map are never invalidated:
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = table.find(name);
+  if (it == table.end()) {
+    it = table.emplace(std::piecewise_construct, std::forward_as_tuple(name),
+                       std::forward_as_tuple(std::hash<std::string>()(name))).first;
+  }
+  data = &*it;
+}
+
+/* * * * * TokenMap_t Class: * * * * */
+
+namespace {
+
+std::atomic<uint64_t> scope_epoch(0);
+
+}  // namespace
+
+uint64_t TokenMap_t::cache_epoch() {
+  return scope_epoch.load(std::memory_order_relaxed);
+}
+
+void TokenMap_t::invalidate_caches() {
+  scope_epoch.fetch_add(1, std::memory_order_relaxed);
+}
+
+TokenMap_t::TokenMap_t(const TokenMap_t& other) {
+  *this = other;
+}
+
+TokenMap_t& TokenMap_t::operator=(const TokenMap_t& other) {
+  if (this != &other) {
+    destroy();
+    for (uint32_t i = 0; i < other.n_values; ++i) {
+      value(new_value()) = other.value(i);
+    }
+    shape = other.shape;
+    dictionary = other.dictionary;
+    entries = other.entries;
+    slots = other.slots;
+    first = other.first;
+    last = other.last;
+    free_list = other.free_list;
+    used_slots = other.used_slots;
+    _size = other._size;
+    filter = other.filter;
+    changed();
   }
   return *this;
 }
 
+// Construct a new value at the end of the last chunk:
+uint32_t TokenMap_t::new_value(packToken* init) {
+  uint32_t c = chunk_of(n_values);
+  if (c == chunks.size()) {
+    size_t capacity = c ? 2u << c : 4;
+    chunks.push_back(static_cast<packToken*>(
+        ::operator new(capacity * sizeof(packToken))));
+  }
+  packToken* slot = &chunks[c][n_values - chunk_start(c)];
+  if (init) {
+    new (slot) packToken(std::move(*init));
+  } else {
+    new (slot) packToken();
+  }
+  return n_values++;
+}
+
+void TokenMap_t::destroy() {
+  for (uint32_t i = 0; i < n_values; ++i) value(i).~packToken();
+  for (packToken* chunk : chunks) ::operator delete(chunk);
+  chunks.clear();
+  n_values = 0;
+}
+
+uint32_t TokenMap_t::find_entry(const std::string& key, size_t hash) const {
+  if (!may_contain(hash)) return NIL;
+  if (!dictionary) return shape->find(key, hash);
+
+  size_t mask = slots.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    const slot_t& slot = slots[i];
+    if (slot.entry == NIL) return NIL;
+    if (slot.entry != DELETED && slot.hash == uint32_t(hash) &&
+        entries[slot.entry].key == key) {
+      return slot.entry;
+    }
+  }
+}
+
+uint32_t TokenMap_t::find_entry(atom_t key) const {
+  if (!may_contain(key.hash())) return NIL;
+  if (!dictionary) return shape->find(key);
+
+  size_t mask = slots.size() - 1;
+  for (size_t i = key.hash() & mask;; i = (i + 1) & mask) {
+    const slot_t& slot = slots[i];
+    if (slot.entry == NIL) return NIL;
+    if (slot.entry == DELETED || slot.hash != uint32_t(key.hash())) continue;
+
+    const entry_t& found = entries[slot.entry];
+    if (found.atom == key) return slot.entry;
+
+    // Entries inserted by string only compare the string once:
+    if (!found.atom && found.key == key.str()) {
+      found.atom = key;
+      return slot.entry;
+    }
+  }
+}
+
+// Rebuild the table, the values are not moved:
+void TokenMap_t::rehash(size_t capacity) {
+  slots.assign(capacity, slot_t{NIL, 0});
+  used_slots = _size;
+  filter = 0;
+
+  size_t mask = capacity - 1;
+  for (uint32_t e = first; e != NIL; e = entries[e].next) {
+    size_t i = entries[e].hash & mask;
+    while (slots[i].entry != NIL) i = (i + 1) & mask;
+    slots[i] = slot_t{e, uint32_t(entries[e].hash)};
+    filter |= filter_bits(entries[e].hash);
+  }
+}
+
+// Append the entry to the insertion order list:
+void TokenMap_t::link(uint32_t i) {
+  entries[i].prev = last;
+  entries[i].next = NIL;
+  if (last == NIL) {
+    first = i;
+  } else {
+    entries[last].next = i;
+  }
+  last = i;
+}
+
+// Copy the keys of the shape into a hash table of this map:
+void TokenMap_t::to_dictionary() {
+  dictionary = true;
+  entries.reserve(n_values + 1);
+  for (uint32_t i = 0; i < n_values; ++i) {
+    const shape_t::key_t& key = shape->keys[i];
+    entries.push_back(entry_t{key.name, key.hash, NIL, NIL, key.atom});
+    link(i);
+  }
+  shape.reset();
+
+  size_t capacity = 8;
+  while ((_size + 1) * 2 > capacity) capacity *= 2;
+  rehash(capacity);
+}
+
+packToken& TokenMap_t::operator[](const std::string& key) {
+  size_t hash = std::hash<std::string>()(key);
+  uint32_t e = find_entry(key, hash);
+  if (e == NIL) e = insert_entry(key, hash, atom_t());
+  return value(e);
+}
+
+packToken& TokenMap_t::operator[](atom_t key) {
+  uint32_t e = find_entry(key);
+  if (e == NIL) e = insert_entry(key.str(), key.hash(), key);
+  return value(e);
+}
+
+uint32_t TokenMap_t::insert_entry(const std::string& key, size_t hash,
+                                  atom_t atom, packToken* init) {
+  if (!dictionary) {
+    if (_size < MAX_SHAPE_KEYS) {
+      shape = (shape ? *shape : shape_t::empty()).add(key, hash, atom);
+      filter = shape->filter;
+      ++_size;
+      changed();
+      return new_value(init);
+    }
+    to_dictionary();
+  }
+
+  uint32_t e;
+
+  // Keep at most half of the slots in use:
+  if ((used_slots + 1) * 2 > slots.size()) {
+    size_t capacity = slots.empty() ? 8 : slots.size();
+    while ((_size + 1) * 2 > capacity) capacity *= 2;
+    rehash(capacity);
+  }
+
+  if (free_list != NIL) {
+    e = free_list;
+    free_list = entries[e].next;
+    entries[e].key = key;
+    entries[e].hash = hash;
+    entries[e].atom = atom;
+    if (init) value(e) = std::move(*init);
+  } else {
+    e = new_value(init);
+    entries.push_back(entry_t{key, hash, NIL, NIL, atom});
+  }
+  link(e);
+  ++_size;
+
+  size_t mask = slots.size() - 1;
+  size_t i = hash & mask;
+  while (slots[i].entry != NIL && slots[i].entry != DELETED) i = (i + 1) & mask;
+  if (slots[i].entry == NIL) ++used_slots;
+  slots[i] = slot_t{e, uint32_t(hash)};
+  filter |= filter_bits(hash);
+
+  changed();
+  return e;
+}
+
+void TokenMap_t::erase(iterator it) {
+  if (!dictionary) to_dictionary();
+
+  uint32_t e = it.i;
+  entry_t& erased = entries[e];
+
+  size_t mask = slots.size() - 1;
+  size_t i = erased.hash & mask;
+  while (slots[i].entry != e) i = (i + 1) & mask;
+  slots[i].entry = DELETED;
+
+  if (erased.prev == NIL) {
+    first = erased.next;
+  } else {
+    entries[erased.prev].next = erased.next;
+  }
+  if (erased.next == NIL) {
+    last = erased.prev;
+  } else {
+    entries[erased.next].prev = erased.prev;
+  }
+
+  // Release the key and value and reuse the entry later:
+  erased.key.clear();
+  erased.atom = atom_t();
+  value(e) = packToken();
+  erased.next = free_list;
+  free_list = e;
+  --_size;
+
+  changed();
+}
+
+void TokenMap_t::reserve(size_t n) {
+  chunks.reserve(chunk_of(n ? uint32_t(n - 1) : 0) + 1);
+  if (n <= MAX_SHAPE_KEYS) return;
+
+  if (!dictionary) to_dictionary();
+  entries.reserve(n);
+  size_t capacity = slots.size();
+  while (n * 2 > capacity) capacity *= 2;
+  if (capacity > slots.size()) rehash(capacity);
+}
+
+size_t TokenMap_t::erase(const std::string& key) {
+  iterator it = find(key);
+  if (it == end()) return 0;
+  erase(it);
+  return 1;
+}
+
+size_t TokenMap_t::memory() const {
+  size_t bytes = chunks.capacity() * sizeof(packToken*) +
+                 entries.capacity() * sizeof(entry_t) +
+                 slots.capacity() * sizeof(slot_t);
+  for (uint32_t c = 0; c < chunks.size(); ++c) {
+    bytes += (c ? 2u << c : 4) * sizeof(packToken);
+  }
+  return bytes;
+}
+
+void TokenMap_t::clear() {
+  destroy();
+  shape.reset();
+  dictionary = false;
+  entries.clear();
+  slots.clear();
+  first = last = free_list = NIL;
+  _size = used_slots = 0;
+  filter = 0;
+
+  changed();
+}
+
+/* * * * * TokenMap_t::shape_t Struct: * * * * */
+
+namespace {
+
+std::atomic<uint64_t> shape_ids(0);
+
+// The shape cache of an atom keeps `shape id << 8 | index`,
+// where the index NO_KEY caches a miss:
+const uint64_t NO_KEY = 0xFF;
+
+}  // namespace
+
+struct TokenMap_t::shape_t::transitions_t {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::weak_ptr<const shape_t>> next;
+  // Expired transitions are dropped when reaching this size:
+  size_t sweep_at = 8;
+};
+
+TokenMap_t::shape_t::shape_t() : id(++shape_ids), transitions(new transitions_t()) {}
+TokenMap_t::shape_t::~shape_t() {}
+
+const TokenMap_t::shape_t& TokenMap_t::shape_t::empty() {
+  // Never destroyed, so maps can be destroyed during static destruction:
+  static const std::shared_ptr<shape_t>& root =
+      *new std::shared_ptr<shape_t>(std::make_shared<shape_t>());
+  return *root;
+}
+
+uint32_t TokenMap_t::shape_t::find(const std::string& name, size_t hash) const {
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    if (keys[i].hash == hash && keys[i].name == name) return i;
+  }
+  return NIL;
+}
+
+uint32_t TokenMap_t::shape_t::find(atom_t name) const {
+  std::atomic<uint64_t>& cache = name.shape_cache();
+  uint64_t cached = cache.load(std::memory_order_relaxed);
+  if ((cached >> 8) == id) {
+    return (cached & 0xFF) == NO_KEY ? NIL : uint32_t(cached & 0xFF);
+  }
+
+  uint64_t found = NO_KEY;
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    const key_t& key = keys[i];
+    if (key.atom == name || (!key.atom && key.hash == name.hash() &&
+                             key.name == name.str())) {
+      found = i;
+      break;
+    }
+  }
+
+  cache.store(id << 8 | found, std::memory_order_relaxed);
+  return found == NO_KEY ? NIL : uint32_t(found);
+}
+
+std::shared_ptr<const TokenMap_t::shape_t>
+TokenMap_t::shape_t::add(const std::string& name, size_t hash, atom_t atom) const {
+  std::lock_guard<std::mutex> lock(transitions->mutex);
+  std::weak_ptr<const shape_t>& transition = transitions->next[name];
+  std::shared_ptr<const shape_t> result = transition.lock();
+  if (result) return result;
+
+  std::shared_ptr<shape_t> shape = std::make_shared<shape_t>();
+  shape->keys.reserve(keys.size() + 1);
+  shape->keys = keys;
+  shape->keys.push_back(key_t{name, hash, atom});
+  shape->filter = filter | filter_bits(hash);
+  shape->parent = shared_from_this();
+  transition = shape;
+
+  // Drop the transitions to shapes no map uses anymore:
+  if (transitions->next.size() >= transitions->sweep_at) {
+    for (auto it = transitions->next.begin(); it != transitions->next.end();) {
+      if (it->second.expired()) {
+        it = transitions->next.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    transitions->sweep_at = 2 * transitions->next.size() + 8;
+  }
+
+  return shape;
+}
+
 /* * * * * TokenMap Class: * * * * */
 
+namespace {
+
+// Walk the parent scopes hashing the key only once:
+template <typename Map>
+Map* find_owner(Map* scope, const std::string& key, size_t hash,
+                packToken** value) {
+  for (; scope; scope = scope->parent()) {
+    TokenMap_t::iterator it = scope->map().find(key, hash);
+    if (it != scope->map().end()) {
+      *value = &it->second;
+      return scope;
+    }
+    if (scope->resolver() && (*value = scope->resolve(key))) return scope;
+  }
+  *value = 0;
+  return 0;
+}
+
+// Results of the lookups by atom that reached the parent scopes,
+// e.g. builtin functions called from a function's local scope.
+//
+// Each thread has its own direct-mapped cache. Since maps with
+// children call TokenMap_t::invalidate_caches() when keys are added
+// or erased, an entry is valid while the epoch doesn't change.
+struct scopeCacheEntry_t {
+  uint64_t uid;
+  const void* key;
+  uint64_t epoch;
+  packToken* value;
+  TokenMap* owner;
+};
+
+const size_t SCOPE_CACHE_SIZE = 256;
+thread_local scopeCacheEntry_t scope_cache[SCOPE_CACHE_SIZE];
+
+// Find `key` on the parents of `scope`:
+const scopeCacheEntry_t& find_on_parents(const TokenMap* scope, atom_t key) {
+  uint64_t uid = scope->map().uid();
+  uint64_t epoch = TokenMap_t::cache_epoch();
+  scopeCacheEntry_t& entry =
+      scope_cache[(key.hash() ^ (uid * 0x9E3779B97F4A7C15ull)) >> 7 &
+                  (SCOPE_CACHE_SIZE - 1)];
+  if (entry.uid == uid && entry.key == key.id() && entry.epoch == epoch) {
+    return entry;
+  }
+
+  entry.uid = uid;
+  entry.key = key.id();
+  entry.epoch = epoch;
+  entry.value = 0;
+  bool resolvers = false;
+  for (entry.owner = scope->parent(); entry.owner;
+       entry.owner = entry.owner->parent()) {
+    TokenMap_t::iterator it = entry.owner->map().find(key);
+    if (it != entry.owner->map().end()) {
+      entry.value = &it->second;
+      break;
+    }
+    if (entry.owner->resolver()) {
+      resolvers = true;
+      if ((entry.value = entry.owner->resolve(key.str(), key))) break;
+    }
+  }
+
+  // Resolvers may define the name later, so their misses aren't kept:
+  if (!entry.value && resolvers) entry.key = 0;
+  return entry;
+}
+
+}  // namespace
+
 packToken* TokenMap::find(const std::string& key) {
+  packToken* value;
+  find_owner(this, key, std::hash<std::string>()(key), &value);
+  return value;
+}
+
+const packToken* TokenMap::find(const std::string& key) const {
+  packToken* value;
+  find_owner(this, key, std::hash<std::string>()(key), &value);
+  return value;
+}
+
+TokenMap* TokenMap::findMap(const std::string& key) {
+  packToken* value;
+  return find_owner(this, key, std::hash<std::string>()(key), &value);
+}
+
+packToken* TokenMap::find(atom_t key) {
   TokenMap_t::iterator it = map().find(key);
 
   if (it != map().end()) {
     return &it->second;
+  }
+
+  packToken* value = resolver() ? resolve(key.str(), key) : 0;
+  if (value) {
+    return value;
   } else if (parent()) {
-    return parent()->find(key);
+    return find_on_parents(this, key).value;
   } else {
     return 0;
   }
 }
 
-const packToken* TokenMap::find(const std::string& key) const {
+const packToken* TokenMap::find(atom_t key) const {
   TokenMap_t::const_iterator it = map().find(key);
 
   if (it != map().end()) {
     return &it->second;
+  }
+
+  packToken* value = resolver() ? resolve(key.str(), key) : 0;
+  if (value) {
+    return value;
   } else if (parent()) {
-    return parent()->find(key);
+    return find_on_parents(this, key).value;
   } else {
     return 0;
   }
 }
 
-TokenMap* TokenMap::findMap(const std::string& key) {
+TokenMap* TokenMap::findMap(atom_t key) {
   TokenMap_t::iterator it = map().find(key);
 
-  if (it != map().end()) {
+  if (it != map().end() || (resolver() && resolve(key.str(), key))) {
     return this;
   } else if (parent()) {
-    return parent()->findMap(key);
+    return find_on_parents(this, key).owner;
   } else {
     return 0;
   }
@@ -172,10 +760,266 @@ packToken& TokenMap::operator[](const std::string& key) {
   return map()[key];
 }
 
+packToken& TokenMap::operator[](atom_t key) {
+  return map()[key];
+}
+
 TokenMap TokenMap::getChild() {
   return TokenMap(this);
 }
 
+TokenMap TokenMap::copy() const {
+  TokenMap result(parent());
+  result.map() = map();
+  return result;
+}
+
 void TokenMap::erase(std::string key) {
   map().erase(key);
 }
+
+void TokenMap::set_resolver(std::shared_ptr<VariableResolver> resolver) {
+  ref->resolver = resolver;
+  // Lookups from child scopes that missed may now be resolved:
+  if (map().get_has_children()) TokenMap_t::invalidate_caches();
+}
+
+packToken* TokenMap::resolve(const std::string& key, atom_t atom) const {
+  packToken value;
+  if (!ref->resolver || !ref->resolver->resolve(key, &value)) return 0;
+
+  packToken& saved = atom ? map()[atom] : map()[key];
+  saved = value;
+  return &saved;
+}
+
+/* * * * * CycleCollector: * * * * */
+
+std::atomic<bool> CycleCollector::pending(false);
+std::atomic<bool> gc_node_t::tracking(false);
+
+namespace {
+
+// Held during the graph walk of a collection, so threads
+// creating containers meanwhile sleep instead of spinning:
+std::mutex gc_mutex;
+gc_node_t* gc_nodes = 0;
+size_t gc_created = 0;
+size_t gc_threshold = 0;
+CycleCollector::result_t gc_total;
+
+}  // namespace
+
+void gc_node_t::link() {
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  next = gc_nodes;
+  if (next) next->prev = this;
+  gc_nodes = this;
+  tracked = true;
+
+  if (gc_threshold && ++gc_created >= gc_threshold) {
+    CycleCollector::pending = true;
+  }
+}
+
+void gc_node_t::untrack() {
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  if (prev) prev->next = next; else gc_nodes = next;
+  if (next) next->prev = prev;
+  tracked = false;
+}
+
+void CycleCollector::enable(bool on) {
+  gc_node_t::tracking = on;
+}
+
+void CycleCollector::set_threshold(size_t count) {
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  gc_threshold = count;
+  gc_created = 0;
+  pending = false;
+}
+
+CycleCollector::result_t CycleCollector::total() {
+  std::lock_guard<std::mutex> lock(gc_mutex);
+  return gc_total;
+}
+
+namespace {
+
+// The items vector of a list is a node of its own,
+// since copies of the list share it:
+enum node_kind_t { MAP_DATA, LIST_DATA, LIST_ITEMS };
+
+struct gc_info_t {
+  node_kind_t kind;
+  // The references not coming from other nodes, after the trial deletion:
+  int64_t refs;
+  bool reachable = false;
+
+  gc_info_t(node_kind_t kind, int64_t refs) : kind(kind), refs(refs) {}
+};
+
+typedef std::unordered_map<const void*, gc_info_t> gc_graph_t;
+typedef std::vector<std::shared_ptr<const void>> gc_edges_t;
+
+size_t token_bytes(const packToken& token) {
+  switch (token->type) {
+    case STR: return sizeof(Token<std::string>);
+    case REAL: return sizeof(Token<double>);
+    case INT: return sizeof(Token<int64_t>);
+    case BOOL: return sizeof(Token<uint8_t>);
+    case NONE: return sizeof(TokenNone);
+    case MAP: return sizeof(TokenMap);
+    case LIST: case TUPLE: case STUPLE: return sizeof(TokenList);
+    case NUM_ARRAY: return sizeof(NumArray);
+    default: return sizeof(TokenBase);
+  }
+}
+
+}  // namespace
+
+struct CycleCollector::visitor_t {
+  static void token_edge(const packToken& token, gc_edges_t* edges) {
+    switch (token->type) {
+      case MAP:
+        edges->push_back(static_cast<const TokenMap*>(token.token())->ref);
+        break;
+      case LIST: case TUPLE: case STUPLE:
+        edges->push_back(static_cast<const TokenList*>(token.token())->ref);
+        break;
+      default:
+        break;
+    }
+  }
+
+  // The references of a node to other containers:
+  static void edges(const void* node, node_kind_t kind, gc_edges_t* edges) {
+    if (kind == MAP_DATA) {
+      const MapData_t* data = static_cast<const MapData_t*>(node);
+      if (data->parent.ref) edges->push_back(data->parent.ref);
+      for (const auto& item : data->map) token_edge(item.second, edges);
+    } else if (kind == LIST_DATA) {
+      edges->push_back(static_cast<const ListData_t*>(node)->items);
+    } else {
+      for (const packToken& item : *static_cast<const TokenList_t*>(node)) {
+        token_edge(item, edges);
+      }
+    }
+  }
+
+  static size_t bytes(const void* node, node_kind_t kind) {
+    size_t bytes = 0;
+    if (kind == MAP_DATA) {
+      const MapData_t* data = static_cast<const MapData_t*>(node);
+      bytes = sizeof(MapData_t) + data->map.memory();
+      for (const auto& item : data->map) bytes += token_bytes(item.second);
+    } else if (kind == LIST_DATA) {
+      bytes = sizeof(ListData_t);
+    } else {
+      const TokenList_t* items = static_cast<const TokenList_t*>(node);
+      bytes = sizeof(TokenList_t) + items->capacity() * sizeof(packToken);
+      for (const packToken& item : *items) bytes += token_bytes(item);
+    }
+    return bytes;
+  }
+};
+
+CycleCollector::result_t CycleCollector::collect() {
+  gc_graph_t graph;
+  std::vector<const void*> garbage;
+  gc_edges_t edges, holds;
+  result_t result;
+
+  {
+    std::lock_guard<std::mutex> lock(gc_mutex);
+    gc_created = 0;
+    pending = false;
+
+    // Count the references to each node, before
+    // any of them is copied into `edges`:
+    for (gc_node_t* node = gc_nodes; node; node = node->next) {
+      if (node->kind == gc_node_t::MAP_NODE) {
+        MapData_t* data = static_cast<MapData_t*>(node);
+        graph.emplace(data, gc_info_t(MAP_DATA,
+                                      data->shared_from_this().use_count() - 1));
+      } else {
+        ListData_t* data = static_cast<ListData_t*>(node);
+        graph.emplace(data, gc_info_t(LIST_DATA,
+                                      data->shared_from_this().use_count() - 1));
+        graph.emplace(data->items.get(),
+                      gc_info_t(LIST_ITEMS, data->items.use_count()));
+      }
+    }
+
+    // Trial deletion: remove the references between nodes, the nodes
+    // still referenced are reachable from outside of the graph:
+    for (auto& node : graph) {
+      edges.clear();
+      visitor_t::edges(node.first, node.second.kind, &edges);
+      for (const auto& edge : edges) {
+        auto target = graph.find(edge.get());
+        if (target != graph.end()) --target->second.refs;
+      }
+    }
+
+    std::vector<const void*> stack;
+    for (auto& node : graph) {
+      if (node.second.refs > 0) {
+        node.second.reachable = true;
+        stack.push_back(node.first);
+      }
+    }
+
+    while (!stack.empty()) {
+      const void* node = stack.back();
+      stack.pop_back();
+
+      edges.clear();
+      visitor_t::edges(node, graph.at(node).kind, &edges);
+      for (const auto& edge : edges) {
+        auto target = graph.find(edge.get());
+        if (target != graph.end() && !target->second.reachable) {
+          target->second.reachable = true;
+          stack.push_back(target->first);
+        }
+      }
+    }
+
+    // Every unreachable node is referenced by another one, keep
+    // these references so none is freed while they are cleared:
+    for (auto& node : graph) {
+      if (node.second.reachable) continue;
+      garbage.push_back(node.first);
+      result.bytes += visitor_t::bytes(node.first, node.second.kind);
+      if (node.second.kind != LIST_ITEMS) ++result.containers;
+
+      edges.clear();
+      visitor_t::edges(node.first, node.second.kind, &edges);
+      for (const auto& edge : edges) {
+        auto target = graph.find(edge.get());
+        if (target != graph.end() && !target->second.reachable) {
+          holds.push_back(edge);
+        }
+      }
+    }
+
+    gc_total.containers += result.containers;
+    gc_total.bytes += result.bytes;
+  }
+
+  // Break the cycles, the nodes are freed with `holds`
+  // (and the lock is released, since freeing them untracks them):
+  for (const void* node : garbage) {
+    node_kind_t kind = graph.at(node).kind;
+    if (kind == MAP_DATA) {
+      const_cast<MapData_t*>(static_cast<const MapData_t*>(node))->map.clear();
+    } else if (kind == LIST_ITEMS) {
+      const_cast<TokenList_t*>(static_cast<const TokenList_t*>(node))->clear();
+    }
+  }
+  edges.clear();
+  holds.clear();
+
+  return result;
+}
@@ -3,19 +3,64 @@
 #define CONTAINERS_H_
 
 #include <map>
+#include <atomic>
 #include <list>
 #include <vector>
 #include <string>
 #include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <functional>
+#include <type_traits>
+
+// While CycleCollector is enabled, maps and lists created by Container
+// are linked on a global list, so it can find the ones kept alive only
+// by cycles:
+struct gc_node_t {
+  enum kind_t : uint8_t { MAP_NODE, LIST_NODE };
+
+  gc_node_t* prev = 0;
+  gc_node_t* next = 0;
+  kind_t kind;
+  bool tracked = false;
+
+  explicit gc_node_t(kind_t kind) : kind(kind) {}
+  // Copies are only tracked once a Container owns them:
+  gc_node_t(const gc_node_t& other) : kind(other.kind) {}
+  gc_node_t& operator=(const gc_node_t&) { return *this; }
+  ~gc_node_t() { if (tracked) untrack(); }
+
+  void track() {
+    if (!tracked && tracking.load(std::memory_order_relaxed)) link();
+  }
+  void untrack();
+
+ private:
+  // Off by default, so hosts that don't collect never take the lock:
+  static std::atomic<bool> tracking;
+  friend struct CycleCollector;
+  void link();
+};
+
+struct CycleCollector;
 
 template <typename T>
 class Container {
  protected:
   std::shared_ptr<T> ref;
 
+  static void track(gc_node_t* node) { node->track(); }
+  static void track(void*) {}
+
  public:
-  Container() : ref(std::make_shared<T>()) {}
-  Container(const T& t) : ref(std::make_shared<T>(t)) {}
+  Container() : ref(std::make_shared<T>()) { track(ref.get()); }
+  Container(const T& t) : ref(std::make_shared<T>(t)) { track(ref.get()); }
+  explicit Container(std::shared_ptr<T> ref) : ref(ref) {
+    if (ref) track(ref.get());
+  }
+
+  friend struct CycleCollector;
 
  public:
   operator T*() const { return ref.get(); }
@@ -47,18 +92,294 @@ struct Iterator : public Iterable {
   Iterator* getIterator() const;
 };
 
-class TokenMap;
-typedef std::map<std::string, packToken> TokenMap_t;
+// Storage of the TokenMap keys and values.
+//
+// The values live on chunks that are never moved, so references to them
+// stay valid until they are erased. Iteration follows the insertion order.
+//
+// Maps start with a shape: a key layout shared by every map that got the
+// same keys in the same order, e.g. objects built by the same code, so
+// each of them only stores its values. A map gets a hash table of its own
+// (dictionary mode) when a key is erased or it has too many keys.
+class TokenMap_t {
+ public:
+  typedef std::pair<std::string, packToken> value_type;
+
+  // The key layout of shaped maps. It is immutable,
+  // adding a key moves the map to another shape:
+  struct shape_t : public std::enable_shared_from_this<shape_t> {
+    struct key_t {
+      std::string name;
+      size_t hash;
+      atom_t atom;
+    };
+    std::vector<key_t> keys;
+    uint64_t filter = 0;
+    // Unique for each shape, e.g. to be used as a cache key:
+    uint64_t id;
+
+    shape_t();
+    ~shape_t();
+
+    uint32_t find(const std::string& name, size_t hash) const;
+    // Cached on the atom, so repeated accesses to the
+    // same attribute of same shaped maps don't search:
+    uint32_t find(atom_t name) const;
+
+    // The shape with one more key, shared with the other maps
+    // that added the same key to this shape:
+    std::shared_ptr<const shape_t> add(const std::string& name, size_t hash,
+                                       atom_t atom) const;
+    static const shape_t& empty();
+
+   private:
+    // Keeps the shapes with fewer keys, so the maps
+    // built the same way keep sharing them:
+    std::shared_ptr<const shape_t> parent;
+
+    struct transitions_t;
+    std::unique_ptr<transitions_t> transitions;
+  };
+
+  // Larger maps use dictionary mode:
+  static const uint32_t MAX_SHAPE_KEYS = 16;
 
-struct MapData_t {
-  TokenMap_t map;
-  TokenMap* parent;
-  MapData_t();
-  MapData_t(TokenMap* p);
-  MapData_t(const MapData_t& other);
-  ~MapData_t();
+ private:
+  static const uint32_t NIL = UINT32_MAX;
+  static const uint32_t DELETED = UINT32_MAX - 1;
 
-  MapData_t& operator=(const MapData_t& other);
+  // The keys of a map in dictionary mode:
+  struct entry_t {
+    std::string key;
+    size_t hash;
+    uint32_t prev, next;
+    // Set once the entry is found or inserted by atom:
+    mutable atom_t atom;
+  };
+
+  struct slot_t {
+    uint32_t entry;
+    uint32_t hash;  // The low bits of the entry hash
+  };
+
+  // Chunk 0 holds the values [0, 4) and each chunk c > 0 holds
+  // [2^(c+1), 2^(c+2)), so empty maps allocate nothing:
+  std::vector<packToken*> chunks;
+  uint32_t n_values = 0;
+
+  // Null on empty maps and in dictionary mode:
+  std::shared_ptr<const shape_t> shape;
+  bool dictionary = false;
+
+  // Dictionary mode, the entry i holds the key of the value i:
+  std::vector<entry_t> entries;
+  std::vector<slot_t> slots;
+  uint32_t first = NIL, last = NIL;
+  uint32_t free_list = NIL;
+  size_t used_slots = 0;  // Including DELETED ones
+  size_t _size = 0;
+
+  // Bloom filter with 2 bits per key, so most misses
+  // are detected without probing the table:
+  uint64_t filter = 0;
+  static uint64_t filter_bits(size_t hash) {
+    return (uint64_t(1) << ((hash >> 7) & 63)) |
+           (uint64_t(1) << ((hash >> 13) & 63));
+  }
+
+  uint64_t _uid = new_version_stamp();
+  // Set from any thread that creates a child scope of a shared map:
+  std::atomic<bool> has_children{false};
+
+  static uint32_t chunk_of(uint32_t i) {
+    if (i < 4) return 0;
+#if defined(__GNUC__)
+    return 30 - __builtin_clz(i);
+#else
+    uint32_t c = 1;
+    while ((4u << c) <= i) ++c;
+    return c;
+#endif
+  }
+  static uint32_t chunk_start(uint32_t c) { return c ? 2u << c : 0; }
+
+  packToken& value(uint32_t i) const {
+    uint32_t c = chunk_of(i);
+    return chunks[c][i - chunk_start(c)];
+  }
+  const std::string& key(uint32_t i) const {
+    return dictionary ? entries[i].key : shape->keys[i].name;
+  }
+  uint32_t next(uint32_t i) const {
+    if (dictionary) return entries[i].next;
+    return i + 1 < n_values ? i + 1 : NIL;
+  }
+  // Moves `init` into the new value when given:
+  uint32_t new_value(packToken* init = 0);
+  void destroy();
+
+  uint32_t find_entry(const std::string& key, size_t hash) const;
+  uint32_t find_entry(atom_t key) const;
+  uint32_t insert_entry(const std::string& key, size_t hash, atom_t atom,
+                        packToken* init = 0);
+  void to_dictionary();
+  void rehash(size_t capacity);
+  void link(uint32_t i);
+  // Called when keys are added or erased:
+  void changed() {
+    if (has_children.load(std::memory_order_relaxed)) invalidate_caches();
+  }
+
+ public:
+  // Iterators give pairs of references to the key and the value:
+  template <typename Value>
+  struct item_t {
+    const std::string& first;
+    Value& second;
+  };
+
+  template <typename Map, typename Value>
+  class iterator_t {
+    Map* map;
+    uint32_t i;
+
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef TokenMap_t::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef item_t<Value> reference;
+    struct pointer {
+      reference item;
+      const reference* operator->() const { return &item; }
+    };
+
+    iterator_t(Map* map = 0, uint32_t i = NIL) : map(map), i(i) {}
+    template <typename M, typename V>
+    iterator_t(const iterator_t<M, V>& other)
+              : map(other.map), i(other.i) {}
+
+    reference operator*() const { return reference{map->key(i), map->value(i)}; }
+    pointer operator->() const { return pointer{**this}; }
+    iterator_t& operator++() { i = map->next(i); return *this; }
+    iterator_t operator++(int) { iterator_t it = *this; ++*this; return it; }
+
+    bool operator==(const iterator_t& other) const { return i == other.i; }
+    bool operator!=(const iterator_t& other) const { return i != other.i; }
+
+    template <typename M, typename V> friend class iterator_t;
+    friend class TokenMap_t;
+  };
+
+  typedef iterator_t<TokenMap_t, packToken> iterator;
+  typedef iterator_t<const TokenMap_t, const packToken> const_iterator;
+
+ public:
+  TokenMap_t() {}
+  TokenMap_t(const TokenMap_t& other);
+  TokenMap_t& operator=(const TokenMap_t& other);
+  ~TokenMap_t() { destroy(); }
+
+  // Unique for each map, copies get a new one:
+  uint64_t uid() const { return _uid; }
+
+  // TokenMap::find() caches lookups that reach the parent scopes.
+  //
+  // The caches are dropped when a parent scope changes,
+  // so maps must be marked when they become a parent:
+  // Only stores when unset, so marking a parent again is read-only:
+  void set_has_children() {
+    if (!has_children.load(std::memory_order_relaxed)) {
+      has_children.store(true, std::memory_order_relaxed);
+    }
+  }
+  bool get_has_children() const {
+    return has_children.load(std::memory_order_relaxed);
+  }
+  static uint64_t cache_epoch();
+  static void invalidate_caches();
+
+  bool may_contain(size_t hash) const {
+    return (filter & filter_bits(hash)) == filter_bits(hash);
+  }
+
+  // The shared layout of the keys, or NULL in dictionary mode:
+  const shape_t* get_shape() const { return shape.get(); }
+  bool is_dictionary() const { return dictionary; }
+
+ public:
+  iterator begin() { return iterator(this, first_index()); }
+  iterator end() { return iterator(this); }
+  const_iterator begin() const { return const_iterator(this, first_index()); }
+  const_iterator end() const { return const_iterator(this); }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  size_t count(const std::string& key) const { return find(key) != end(); }
+
+  iterator find(const std::string& key) {
+    return iterator(this, find_entry(key, std::hash<std::string>()(key)));
+  }
+  const_iterator find(const std::string& key) const {
+    return const_iterator(this, find_entry(key, std::hash<std::string>()(key)));
+  }
+  iterator find(const std::string& key, size_t hash) {
+    return iterator(this, find_entry(key, hash));
+  }
+  iterator find(atom_t key) { return iterator(this, find_entry(key)); }
+  const_iterator find(atom_t key) const {
+    return const_iterator(this, find_entry(key));
+  }
+
+  packToken& operator[](const std::string& key);
+  packToken& operator[](atom_t key);
+
+  // Like std::map::emplace(), builds the value from `args` if the key is new:
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(const std::string& key, Args&&... args) {
+    size_t hash = std::hash<std::string>()(key);
+    uint32_t e = find_entry(key, hash);
+    if (e != NIL) return std::make_pair(iterator(this, e), false);
+
+    packToken init(std::forward<Args>(args)...);
+    e = insert_entry(key, hash, atom_t(), &init);
+    return std::make_pair(iterator(this, e), true);
+  }
+
+  // Allocate for `n` keys, maps with more than
+  // MAX_SHAPE_KEYS keys use dictionary mode right away:
+  void reserve(size_t n);
+
+  void erase(iterator it);
+  size_t erase(const std::string& key);
+  void clear();
+
+  // The bytes allocated for the values and the keys, shapes
+  // are shared between maps so they are not included:
+  size_t memory() const;
+
+ private:
+  uint32_t first_index() const {
+    if (dictionary) return first;
+    return n_values ? 0 : NIL;
+  }
+};
+
+struct MapData_t;
+
+// Provides the variables missing on a map when they are looked up,
+// e.g. to read the fields of a host record only when an expression
+// uses them. Resolved values are kept on the map, so each name is
+// resolved at most once per map, while names the resolver doesn't
+// define are requested again on each lookup.
+//
+// Since saving a resolved value writes to the map, even const
+// lookups, a map with a resolver (or its child scopes) must not be
+// used from more than one thread at a time, unlike other maps that
+// are only read.
+struct VariableResolver {
+  virtual ~VariableResolver() {}
+  // Set `value` and return true if `name` is defined:
+  virtual bool resolve(const std::string& name, packToken* value) = 0;
 };
 
 struct TokenMap : public Container<MapData_t>, public Iterable {
@@ -70,8 +391,9 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
 
  public:
   // Attribute getters for the `MapData_t` content:
-  TokenMap_t& map() const { return ref->map; }
-  TokenMap* parent() const { return ref->parent; }
+  TokenMap_t& map() const;
+  TokenMap* parent() const;
+  VariableResolver* resolver() const;
 
  public:
   // Implement the Iterable Interface:
@@ -95,17 +417,21 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
   }
 
  public:
-  TokenMap(TokenMap* parent = &TokenMap::base_map())
-          : Container(parent), Iterable(MAP) {
-    // For the TokenBase super class
-    this->type = MAP;
-  }
+  TokenMap(TokenMap* parent = &TokenMap::base_map());
   TokenMap(const TokenMap& other) : Container(other) {
     this->type = MAP;
   }
 
   virtual ~TokenMap() {}
 
+ private:
+  // A handle to no map, used by MapData_t when it has no parent:
+  struct null_t {};
+  explicit TokenMap(null_t) : Container(std::shared_ptr<MapData_t>()) {
+    this->type = MAP;
+  }
+  friend struct MapData_t;
+
  public:
   // Implement the TokenBase abstract class
   TokenBase* clone() const {
@@ -116,6 +442,12 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
   packToken* find(const std::string& key);
   const packToken* find(const std::string& key) const;
   TokenMap* findMap(const std::string& key);
+
+  // Faster lookups for interned names:
+  packToken* find(atom_t key);
+  const packToken* find(atom_t key) const;
+  TokenMap* findMap(atom_t key);
+  packToken& operator[](atom_t key);
   void assign(std::string key, TokenBase* value);
   void insert(std::string key, TokenBase* value);
 
@@ -124,8 +456,67 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
   packToken& operator[](const std::string& str);
 
   void erase(std::string key);
+
+  // A new map with a copy of the keys and the same parent:
+  TokenMap copy() const;
+
+  // Bulk insertion, e.g. of the pairs of a std::map, or moving
+  // them with std::make_move_iterator(). Existing keys are kept:
+  void reserve(size_t n) { map().reserve(n); }
+  template <typename It,
+            typename = typename std::iterator_traits<It>::iterator_category>
+  void insert(It first, It last) {
+    for (; first != last; ++first) {
+      auto&& item = *first;
+      map().emplace(item.first, std::forward<decltype(item)>(item).second);
+    }
+  }
+  template <typename... Args>
+  std::pair<TokenMap_t::iterator, bool> emplace(const std::string& key,
+                                                Args&&... args) {
+    return map().emplace(key, std::forward<Args>(args)...);
+  }
+
+  // Keys missing on this map are requested to the resolver
+  // before searching the parent scopes:
+  void set_resolver(std::shared_ptr<VariableResolver> resolver);
+
+  // Ask the resolver for a missing key and save the value on the map.
+  // Returns NULL if there is no resolver or it doesn't define the key:
+  packToken* resolve(const std::string& key, atom_t atom = atom_t()) const;
+};
+
+struct MapData_t : public gc_node_t,
+                   public std::enable_shared_from_this<MapData_t> {
+  TokenMap_t map;
+
+  // A handle sharing the data of the parent map, it is kept by value
+  // so creating a child scope is a single allocation:
+  TokenMap parent;
+
+  std::shared_ptr<VariableResolver> resolver;
+
+  MapData_t() : gc_node_t(MAP_NODE), parent(TokenMap::null_t()) {}
+  MapData_t(TokenMap* p);
+
+  MapData_t& operator=(const MapData_t& other);
 };
 
+inline TokenMap::TokenMap(TokenMap* parent)
+                         : Container(std::make_shared<MapData_t>(parent)),
+                           Iterable(MAP) {
+  // For the TokenBase super class
+  this->type = MAP;
+}
+
+inline TokenMap_t& TokenMap::map() const { return ref->map; }
+inline TokenMap* TokenMap::parent() const {
+  return ref->parent.ref ? &ref->parent : 0;
+}
+inline VariableResolver* TokenMap::resolver() const {
+  return ref->resolver.get();
+}
+
 // Build a TokenMap which is a child of default_global()
 struct GlobalScope : public TokenMap {
   GlobalScope() : TokenMap(&TokenMap::default_global()) {}
@@ -133,19 +524,68 @@ struct GlobalScope : public TokenMap {
 
 typedef std::vector<packToken> TokenList_t;
 
-struct TokenList : public Container<TokenList_t>, public Iterable {
+// The items of a list are shared with the lists copied from it,
+// and are only copied when one of them is written.
+//
+// Slices are views over the items of another list, with the item i
+// at `(*items)[start + i * step]`, until they are written:
+struct ListData_t : public gc_node_t,
+                    public std::enable_shared_from_this<ListData_t> {
+  std::shared_ptr<TokenList_t> items = std::make_shared<TokenList_t>();
+  bool is_view = false;
+  size_t start = 0, count = 0;
+  int64_t step = 1;
+
+  ListData_t() : gc_node_t(LIST_NODE) {}
+
+  size_t size() const { return is_view ? count : items->size(); }
+  packToken& at(size_t i) const {
+    return is_view ? (*items)[start + int64_t(i) * step] : (*items)[i];
+  }
+};
+
+struct TokenList : public Container<ListData_t>, public Iterable {
   static packToken default_constructor(TokenMap scope);
 
  public:
-  // Attribute getter for the `TokenList_t` content:
-  TokenList_t& list() const { return *ref; }
+  // Attribute getters for the `TokenList_t` content, list()
+  // gives write access so it stops sharing the items first,
+  // both copy the items of slices into a vector of their own:
+  TokenList_t& list() const { detach(); return *ref->items; }
+  const TokenList_t& items() const {
+    if (ref->is_view) materialize();
+    return *ref->items;
+  }
+
+  // Read access that never copies, also on slices:
+  size_t size() const { return ref->size(); }
+  const packToken& at(size_t i) const { return ref->at(i); }
+
+  // A new list with the same items, copied lazily:
+  TokenList copy() const;
+  // A view over `count` items from `start` on, every `step` items:
+  TokenList slice(size_t start, size_t count, int64_t step = 1) const;
+  // Stop sharing the items with copies of this list:
+  void detach() const {
+    if (ref->is_view) {
+      materialize();
+    } else if (ref->items.use_count() > 1) {
+      ref->items = std::make_shared<TokenList_t>(*ref->items);
+    }
+  }
+
+ protected:
+  void materialize() const;
+  void set_slice(const TokenList& source, size_t start,
+                 size_t count, int64_t step);
 
  public:
+  // Iterates over a snapshot of the items:
   struct ListIterator : public Iterator {
-    TokenList_t* list;
+    ListData_t list;
     uint64_t i = 0;
 
-    ListIterator(TokenList_t* list) : list(list) {}
+    ListIterator(const ListData_t& list) : list(list) {}
 
     packToken* next();
     void reset();
@@ -156,21 +596,49 @@ struct TokenList : public Container<TokenList_t>, public Iterable {
   };
 
   Iterator* getIterator() const {
-    return new ListIterator(&list());
+    return new ListIterator(*ref);
   }
 
  public:
   TokenList() { this->type = LIST; }
+  // Takes the items without copying them:
+  explicit TokenList(TokenList_t&& items) {
+    this->type = LIST;
+    *ref->items = std::move(items);
+  }
+  // From a range of anything a packToken is built from, e.g. the doubles
+  // of a std::vector, or tokens moved with std::make_move_iterator():
+  template <typename It,
+            typename = typename std::iterator_traits<It>::iterator_category>
+  TokenList(It first, It last) {
+    this->type = LIST;
+    ref->items->assign(first, last);
+  }
   virtual ~TokenList() {}
 
-  packToken& operator[](const uint64_t idx) const {
-    if (list().size() <= idx) {
+  // Writable, so it stops sharing the items first:
+  packToken& operator[](const uint64_t idx) {
+    if (size() <= idx) {
       throw std::out_of_range("List index out of range!");
     }
     return list()[idx];
   }
+  // Read only, shared items and slices are not copied:
+  const packToken& operator[](const uint64_t idx) const {
+    if (size() <= idx) {
+      throw std::out_of_range("List index out of range!");
+    }
+    return at(idx);
+  }
 
-  void push(packToken val) const { list().push_back(val); }
+  void push(packToken val) const { list().push_back(std::move(val)); }
+  template <typename... Args>
+  packToken& emplace(Args&&... args) const {
+    TokenList_t& items = list();
+    items.emplace_back(std::forward<Args>(args)...);
+    return items.back();
+  }
+  void reserve(size_t n) const { list().reserve(n); }
   packToken pop() const {
     packToken back = list().back();
     list().pop_back();
@@ -201,6 +669,8 @@ class Tuple : public TokenList {
   Tuple(const packToken first, const packToken second)
        : Tuple(first.token(), second.token()) {}
 
+  Tuple slice(size_t start, size_t count, int64_t step = 1) const;
+
  public:
   // Implement the TokenBase abstract class
   TokenBase* clone() const {
@@ -211,7 +681,7 @@ class Tuple : public TokenList {
 // This Special Tuple is to be used only as syntactic sugar, and
 // constructed only with the operator `:`, i.e.:
 // - passing key-word arguments: func(1, 2, optional_arg:10)
-// - slicing lists or strings: my_list[2:10:2] (not implemented)
+// - slicing lists or strings: my_list[2:10:2]
 //
 // STuple means one of:
 // - Special Tuple, Syntactic Tuple or System Tuple
@@ -241,4 +711,105 @@ class STuple : public Tuple {
   }
 };
 
+typedef std::vector<double> NumArray_t;
+
+// A list of numbers stored contiguously, so operations on it
+// run over plain doubles instead of one token per item.
+struct NumArray : public Container<NumArray_t>, public Iterable {
+  static packToken default_constructor(TokenMap scope);
+
+ public:
+  // Attribute getter for the `NumArray_t` content:
+  NumArray_t& array() const { return *ref; }
+
+ public:
+  struct ArrayIterator : public Iterator {
+    std::shared_ptr<NumArray_t> array;
+    uint64_t i = 0;
+    packToken last;
+
+    ArrayIterator(std::shared_ptr<NumArray_t> array) : array(array) {}
+
+    packToken* next();
+    void reset();
+
+    TokenBase* clone() const {
+      return new ArrayIterator(*this);
+    }
+  };
+
+  Iterator* getIterator() const {
+    return new ArrayIterator(ref);
+  }
+
+ public:
+  NumArray() { this->type = NUM_ARRAY; }
+  explicit NumArray(size_t size)
+                   : Container(std::make_shared<NumArray_t>(size)) {
+    this->type = NUM_ARRAY;
+    evalBudget_t::count_bytes(size * sizeof(double));
+  }
+  // Takes the values without copying them:
+  explicit NumArray(NumArray_t&& values)
+                   : Container(std::make_shared<NumArray_t>(std::move(values))) {
+    this->type = NUM_ARRAY;
+  }
+  // Throws bad_cast if an item is not a number:
+  explicit NumArray(const TokenList& list);
+  virtual ~NumArray() {}
+
+  TokenList toList() const;
+  double sum() const;
+
+  // True if no other handle shares this array, e.g. on
+  // temporary results, so it can be overwritten:
+  bool unique() const { return ref.use_count() == 1; }
+
+ public:
+  // Implement the TokenBase abstract class
+  TokenBase* clone() const {
+    return new NumArray(*this);
+  }
+};
+
+// Reference counting never frees maps and lists that reference each
+// other, e.g. after `a.self = a`. The collector finds the tracked ones
+// that are only referenced from other tracked ones (trial deletion)
+// and are not reachable from the rest, and clears them to break
+// their cycles.
+//
+// It must not run while other threads are using containers.
+struct CycleCollector {
+  struct result_t {
+    size_t containers = 0;
+    // Approximate, the maps and lists and the tokens they held:
+    size_t bytes = 0;
+  };
+
+  // Only the maps and lists created while it is enabled are tracked,
+  // the others are never collected. Enable it before creating them:
+  static void enable(bool on = true);
+  static result_t collect();
+
+  // Evaluations never collect on their own. Hosts that want a bound on
+  // the garbage set a threshold and call collect_if_needed() where no
+  // other thread is using containers, e.g. between their evaluations.
+  // It collects once `count` maps and lists were created since the
+  // last collection, 0 disables it:
+  static void set_threshold(size_t count);
+  static void collect_if_needed() {
+    if (pending.load(std::memory_order_relaxed)) collect();
+  }
+
+  // The sum of all the collections so far:
+  static result_t total();
+
+ private:
+  static std::atomic<bool> pending;
+  friend struct gc_node_t;
+
+  // Walks the references between the nodes:
+  struct visitor_t;
+};
+
 #endif  // CONTAINERS_H_
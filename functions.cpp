@@ -59,7 +59,7 @@ packToken Function::call(packToken _this, const Function* func,
     }
 
     // Save it:
-    std::string key = st->list()[0].asString();
+    std::string key = st->list()[0].asConstString();
     packToken& value = st->list()[1];
     kwargs[key] = value;
   }
@@ -79,9 +79,10 @@ packToken Function::call(packToken _this, const Function* func,
 
   /* * * * * Set built-in variables: * * * * */
 
-  local["this"] = _this;
-  local["args"] = arglist;
-  local["kwargs"] = kwargs;
+  static const atom_t THIS("this"), ARGS("args"), KWARGS("kwargs");
+  local[THIS] = _this;
+  local[ARGS] = arglist;
+  local[KWARGS] = kwargs;
 
   return func->exec(local);
 }
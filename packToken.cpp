@@ -1,6 +1,8 @@
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <cstdio>
+#include <mutex>
 
 #include "./shunting-yard.h"
 #include "./packToken.h"
@@ -18,6 +20,7 @@ packToken::strFunc_t& packToken::str_custom() {
 
 packToken::packToken(const TokenMap& map) : base(new TokenMap(map)) {}
 packToken::packToken(const TokenList& list) : base(new TokenList(list)) {}
+packToken::packToken(const NumArray& array) : base(new NumArray(array)) {}
 
 packToken& packToken::operator=(const packToken& t) {
   delete base;
@@ -32,6 +35,8 @@ bool packToken::operator==(const packToken& token) const {
 
   if (token.base->type != base->type) {
     return false;
+  } else if (base->type == STR) {
+    return token.asConstString() == asConstString();
   } else {
     // Compare strings to simplify code
     return token.str() == str();
@@ -88,7 +93,7 @@ bool packToken::asBool() const {
     case BOOL:
       return static_cast<Token<uint8_t>*>(base)->val != 0;
     case STR:
-      return static_cast<Token<std::string>*>(base)->val != std::string();
+      return !static_cast<Token<std::string>*>(base)->value().empty();
     case MAP:
     case FUNC:
       return true;
@@ -96,7 +101,7 @@ bool packToken::asBool() const {
       return false;
     case TUPLE:
     case STUPLE:
-      return static_cast<Tuple*>(base)->list().size() != 0;
+      return static_cast<Tuple*>(base)->size() != 0;
     default:
       throw bad_cast("Token type can not be cast to boolean!");
   }
@@ -145,7 +150,15 @@ std::string& packToken::asString() const {
     throw bad_cast(
       "The Token is not a string!");
   }
-  return static_cast<Token<std::string>*>(base)->val;
+  return static_cast<Token<std::string>*>(base)->mutable_value();
+}
+
+const std::string& packToken::asConstString() const {
+  if (base->type != STR && base->type != VAR && base->type != OP) {
+    throw bad_cast(
+      "The Token is not a string!");
+  }
+  return static_cast<const Token<std::string>*>(base)->value();
 }
 
 TokenMap& packToken::asMap() const {
@@ -180,6 +193,14 @@ STuple& packToken::asSTuple() const {
   return *static_cast<STuple*>(base);
 }
 
+NumArray& packToken::asArray() const {
+  if (base->type != NUM_ARRAY) {
+    throw bad_cast(
+      "The Token is not a numeric array!");
+  }
+  return *static_cast<NumArray*>(base);
+}
+
 Function* packToken::asFunc() const {
   if (base->type != FUNC) {
     throw bad_cast(
@@ -197,8 +218,8 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
   TokenMap_t* tmap;
   TokenMap_t::iterator m_it;
 
-  TokenList_t* tlist;
-  TokenList_t::iterator l_it;
+  const TokenList* tlist;
+  const NumArray_t* narray;
   const Function* func;
   bool first, boolval;
   std::string name;
@@ -227,20 +248,18 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
     case UNARY:
       return "UnaryToken";
     case OP:
-      return static_cast<const Token<std::string>*>(base)->val;
+      return static_cast<const Token<std::string>*>(base)->value();
     case VAR:
-      return static_cast<const Token<std::string>*>(base)->val;
+      return static_cast<const Token<std::string>*>(base)->value();
     case REAL:
-      ss << static_cast<const Token<double>*>(base)->val;
-      return ss.str();
+      return number_str(static_cast<const Token<double>*>(base)->val);
     case INT:
-      ss << static_cast<const Token<int64_t>*>(base)->val;
-      return ss.str();
+      return std::to_string(static_cast<const Token<int64_t>*>(base)->val);
     case BOOL:
       boolval = static_cast<const Token<uint8_t>*>(base)->val;
       return boolval ? "True" : "False";
     case STR:
-      return "\"" + static_cast<const Token<std::string>*>(base)->val + "\"";
+      return "\"" + static_cast<const Token<std::string>*>(base)->value() + "\"";
     case FUNC:
       func = static_cast<const Function*>(base);
       if (func->name().size()) return "[Function: " + func->name() + "]";
@@ -251,13 +270,14 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
       if (nest == 0) return "[Tuple]";
       ss << "(";
       first = true;
-      for (const packToken token : static_cast<const Tuple*>(base)->list()) {
+      tlist = static_cast<const Tuple*>(base);
+      for (size_t i = 0; i < tlist->size(); ++i) {
         if (!first) {
           ss << ", ";
         } else {
           first = false;
         }
-        ss << str(token.token(), nest-1);
+        ss << str(tlist->at(i).token(), nest-1);
       }
       if (first) {
         // Its an empty tuple:
@@ -280,15 +300,25 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
       return ss.str();
     case LIST:
       if (nest == 0) return "[List]";
-      tlist = &(static_cast<const TokenList*>(base)->list());
+      tlist = static_cast<const TokenList*>(base);
       if (tlist->size() == 0) return "[]";
       ss << "[";
-      for (l_it = tlist->begin(); l_it != tlist->end(); ++l_it) {
-        ss << (l_it == tlist->begin() ? "" : ",");
-        ss << " " << l_it->str(nest-1);
+      for (size_t i = 0; i < tlist->size(); ++i) {
+        ss << (i == 0 ? "" : ",");
+        ss << " " << tlist->at(i).str(nest-1);
       }
       ss << " ]";
       return ss.str();
+    case NUM_ARRAY:
+      if (nest == 0) return "[Array]";
+      narray = &(static_cast<const NumArray*>(base)->array());
+      if (narray->size() == 0) return "array()";
+      ss << "array(";
+      for (size_t i = 0; i < narray->size(); ++i) {
+        ss << (i == 0 ? "" : ", ") << (*narray)[i];
+      }
+      ss << ")";
+      return ss.str();
     default:
       if (base->type & IT) {
         return "[Iterator]";
@@ -296,3 +326,61 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
       return "unknown_type";
   }
 }
+
+std::string packToken::number_str(double value) {
+  // The default stream format is "%g":
+  char buffer[32];
+  int size = snprintf(buffer, sizeof(buffer), "%g", value);
+  return std::string(buffer, size);
+}
+
+/* * * * * String builder: * * * * */
+
+struct Token<std::string>::builder_t {
+  std::string buffer;
+  std::mutex mutex;
+};
+
+namespace {
+
+// Shorter results are plain strings:
+const size_t MIN_BUILDER_SIZE = 64;
+
+}  // namespace
+
+void Token<std::string>::flatten() const {
+  std::lock_guard<std::mutex> lock(builder->mutex);
+  if (!flattened.load(std::memory_order_relaxed)) {
+    payload = std::make_shared<std::string>(builder->buffer, 0, size);
+    flattened.store(true, std::memory_order_release);
+  }
+}
+
+Token<std::string>* Token<std::string>::concat(const Token& left,
+                                               const std::string& right) {
+  std::shared_ptr<builder_t> result = std::make_shared<builder_t>();
+
+  if (left.builder) {
+    std::lock_guard<std::mutex> lock(left.builder->mutex);
+    std::string& buffer = left.builder->buffer;
+
+    // Append in place unless another string was built from `left`:
+    if (buffer.size() == left.size) {
+      evalBudget_t::count_bytes(right.size());
+      buffer += right;
+      return new Token(left.builder, buffer.size());
+    }
+
+    evalBudget_t::count_bytes(left.size + right.size());
+    result->buffer.assign(buffer, 0, left.size);
+  } else if (left.payload->size() + right.size() < MIN_BUILDER_SIZE) {
+    evalBudget_t::count_bytes(left.payload->size() + right.size());
+    return new Token(*left.payload + right, STR);
+  } else {
+    evalBudget_t::count_bytes(left.payload->size() + right.size());
+    result->buffer = *left.payload;
+  }
+
+  result->buffer += right;
+  return new Token(result, result->buffer.size());
+}
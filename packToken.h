@@ -2,6 +2,7 @@
 #define PACKTOKEN_H_
 
 #include <string>
+#include <utility>
 
 // Encapsulate TokenBase* into a friendlier interface
 class packToken {
@@ -17,8 +18,13 @@ class packToken {
   packToken() : base(new TokenNone()) {}
   packToken(const TokenBase& t) : base(t.clone()) {}
   packToken(const packToken& t) : base(t.base->clone()) {}
-  packToken(packToken&& t) : base(t.base) { t.base = 0; }
+  // Noexcept, so vectors of tokens move them when they grow:
+  packToken(packToken&& t) noexcept : base(t.base) { t.base = 0; }
   packToken& operator=(const packToken& t);
+  packToken& operator=(packToken&& t) noexcept {
+    std::swap(base, t.base);
+    return *this;
+  }
 
   template<class C>
   packToken(C c, tokType type) : base(new Token<C>(c, type)) {}
@@ -30,8 +36,11 @@ class packToken {
   packToken(double d) : base(new Token<double>(d, REAL)) {}
   packToken(const char* s) : base(new Token<std::string>(s, STR)) {}
   packToken(const std::string& s) : base(new Token<std::string>(s, STR)) {}
+  packToken(std::string&& s)
+    : base(new Token<std::string>(std::move(s), STR)) {}
   packToken(const TokenMap& map);
   packToken(const TokenList& list);
+  packToken(const NumArray& array);
   ~packToken() { delete base; }
 
   TokenBase* operator->() const;
@@ -47,11 +56,16 @@ class packToken {
   bool asBool() const;
   double asDouble() const;
   int64_t asInt() const;
+  // Strings are shared between copies of a token, so asString()
+  // copies the string first if it is shared, use asConstString()
+  // when the string is only read:
   std::string& asString() const;
+  const std::string& asConstString() const;
   TokenMap& asMap() const;
   TokenList& asList() const;
   Tuple& asTuple() const;
   STuple& asSTuple() const;
+  NumArray& asArray() const;
   Function* asFunc() const;
 
   // Specialize this template to your types, e.g.:
@@ -63,6 +77,9 @@ class packToken {
   std::string str(uint32_t nest = 3) const;
   static std::string str(const TokenBase* t, uint32_t nest = 3);
 
+  // Format a number as `std::ostream << value` does, without a stream:
+  static std::string number_str(double value);
+
  public:
   // This constructor makes sure the TokenBase*
   // will be deleted when the packToken destructor is called.
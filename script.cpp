@@ -0,0 +1,387 @@
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <exception>
+
+#include "./script.h"
+#include "./serialization.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SCRIPT_USE_MMAP
+#endif
+
+script::script(const script& other)
+              : config(other.config), _statements(other._statements),
+                scopes(other.scopes) {
+  // Deep copy the tokens, so everything can be
+  // safely deallocated:
+  tokens.reserve(other.tokens.size());
+  for (TokenBase* token : other.tokens) {
+    tokens.push_back(token->clone());
+  }
+}
+
+script::script(script&& other) noexcept
+              : config(other.config), tokens(std::move(other.tokens)),
+                _statements(std::move(other._statements)),
+                scopes(std::move(other.scopes)) {
+  other.tokens.clear();
+  other._statements.clear();
+}
+
+script::~script() {
+  for (TokenBase* token : tokens) delete token;
+}
+
+void script::compile(const char* text, TokenMap vars, const char* delim,
+                     unsigned threads) {
+  const char* end = text + strlen(text);
+
+  uint32_t scope = 0;
+  if (config.bindMode == BIND_BY_REFERENCE) {
+    scopes.push_back(vars);
+    scope = scopes.size();
+  }
+
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  if (threads > 1) {
+    compile_parallel(text, end, vars, delim, scope, threads);
+  } else {
+    compile_range(text, text, end, vars, delim, scope, this);
+  }
+}
+
+const char* script::compile_range(const char* text, const char* begin,
+                                  const char* end, TokenMap vars,
+                                  const char* delim, uint32_t scope,
+                                  script* output) const {
+  const charSet_t delims(delim);
+  const char* expr = begin;
+
+  // A single builder parses all statements:
+  rpnBuilder data(vars, config);
+
+  while (true) {
+    // Skip whitespace and empty statements:
+    while (expr < end && ((rpnBuilder::charClass(*expr) & CC_SPACE) ||
+                          delims.has(*expr))) {
+      ++expr;
+    }
+    if (expr >= end || !*expr) break;
+
+    statement_t statement;
+    statement.offset = expr - text;
+    statement.scope = scope;
+
+    calcError_t error;
+    calculator::toRPN(&data, expr, delims, &expr, config, &error);
+    if (error) error.raise();
+
+    // Move the RPN to the end of the script tokens:
+    statement.begin = output->tokens.size();
+    for (; !data.rpn.empty(); data.rpn.pop()) {
+      output->tokens.push_back(data.rpn.front());
+    }
+    statement.end = output->tokens.size();
+    output->_statements.push_back(statement);
+  }
+
+  return expr;
+}
+
+void script::append(script* other) {
+  size_t shift = tokens.size();
+  tokens.insert(tokens.end(), other->tokens.begin(), other->tokens.end());
+  other->tokens.clear();
+
+  for (statement_t statement : other->_statements) {
+    statement.begin += shift;
+    statement.end += shift;
+    _statements.push_back(statement);
+  }
+  other->_statements.clear();
+}
+
+namespace {
+
+// A read-only view of the contents of a file.
+//
+// When possible the file is memory-mapped instead of copied.
+class fileView_t {
+  const char* _data = 0;
+  size_t _size = 0;
+  bool mapped = false;
+  std::string copy;
+
+ public:
+  // If `nul_terminated` is true the view is followed by a '\0'
+  // as expected by the parser:
+  fileView_t(const std::string& path, bool nul_terminated) {
+#ifdef SCRIPT_USE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Could not open file: " + path);
+    }
+
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    // The last mapped page is zero-filled after the end of the file,
+    // so there is a '\0' after it unless it ends on a page boundary:
+    void* data = MAP_FAILED;
+    if (size > 0 && page_size > 0 &&
+        (!nul_terminated || size % page_size != 0)) {
+      data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (data != MAP_FAILED) {
+      madvise(data, size, MADV_SEQUENTIAL);
+      _data = static_cast<const char*>(data);
+      _size = size;
+      mapped = true;
+      return;
+    }
+#endif
+
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Could not open file: " + path);
+    }
+
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    copy = ss.str();
+    _data = copy.c_str();
+    _size = copy.size();
+  }
+
+  ~fileView_t() {
+#ifdef SCRIPT_USE_MMAP
+    if (mapped) munmap(const_cast<char*>(_data), _size);
+#endif
+  }
+
+  fileView_t(const fileView_t&) = delete;
+  fileView_t& operator=(const fileView_t&) = delete;
+
+  const char* data() const { return _data; }
+  size_t size() const { return _size; }
+};
+
+// Chunks smaller than this are not worth a thread:
+const size_t MIN_CHUNK_SIZE = 16 * 1024;
+
+// Find top-level statement boundaries about `chunk_size` bytes apart.
+//
+// It tracks brackets, string literals and the builtin comments like
+// toRPN() does, so that no boundary falls inside a statement. If it
+// ever disagrees with the parser, e.g. because of a custom reserved
+// word, compile_parallel() detects it and falls back to a sequential
+// compilation.
+std::vector<const char*> split_statements(const char* text, const char* end,
+                                          const charSet_t& delims,
+                                          size_t chunk_size) {
+  std::vector<const char*> cuts;
+  const char* next_cut = text + chunk_size;
+  uint32_t bracketLevel = 0;
+
+  const char* expr = text;
+  while (expr < end) {
+    char c = *expr;
+    if (bracketLevel == 0 && delims.has(c)) {
+      if (expr >= next_cut) {
+        cuts.push_back(expr);
+        next_cut = expr + chunk_size;
+      }
+      ++expr;
+      continue;
+    }
+
+    switch (c) {
+    case '(': case '[': case '{':
+      ++bracketLevel;
+      ++expr;
+      break;
+    case ')': case ']': case '}':
+      if (bracketLevel) --bracketLevel;
+      ++expr;
+      break;
+    case '"': case '\'':
+      ++expr;
+      while (expr < end && *expr != c && *expr != '\n') {
+        if (*expr == '\\' && expr[1] && strchr("nt\"'\n", expr[1])) ++expr;
+        ++expr;
+      }
+      if (expr < end && *expr == c) ++expr;
+      break;
+    case '#':
+      while (expr < end && *expr != '\n') ++expr;
+      break;
+    case '/':
+      if (expr[1] == '/') {
+        while (expr < end && *expr != '\n') ++expr;
+      } else if (expr[1] == '*') {
+        expr += 2;
+        while (expr < end && !(expr[0] == '*' && expr[1] == '/')) ++expr;
+        expr += 2;
+      } else {
+        ++expr;
+      }
+      break;
+    default:
+      ++expr;
+    }
+  }
+
+  return cuts;
+}
+
+}  // namespace
+
+void script::compile_parallel(const char* text, const char* end,
+                              TokenMap vars, const char* delim,
+                              uint32_t scope, unsigned threads) {
+  struct chunk_t {
+    const char* begin;
+    const char* end;
+    const char* rest = 0;
+    script statements;
+    std::exception_ptr error;
+
+    chunk_t(const char* begin, const char* end, const Config_t& config)
+           : begin(begin), end(end), statements(config) {}
+  };
+
+  // Use a few chunks per thread so they finish at about the same time:
+  size_t chunk_size = (end - text) / (threads * 4) + 1;
+  if (chunk_size < MIN_CHUNK_SIZE) chunk_size = MIN_CHUNK_SIZE;
+
+  std::vector<chunk_t> chunks;
+  const char* begin = text;
+  for (const char* cut : split_statements(text, end, charSet_t(delim), chunk_size)) {
+    chunks.emplace_back(begin, cut, config);
+    begin = cut;
+  }
+  chunks.emplace_back(begin, end, config);
+
+  std::atomic<size_t> next_chunk(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next_chunk++) < chunks.size()) {
+      chunk_t& chunk = chunks[i];
+      try {
+        chunk.rest = compile_range(text, chunk.begin, chunk.end,
+                                   vars, delim, scope, &chunk.statements);
+      } catch (...) {
+        chunk.error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned i = 1; i < threads && i < chunks.size(); ++i) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : pool) thread.join();
+
+  // Merge the results in source order:
+  for (chunk_t& chunk : chunks) {
+    append(&chunk.statements);
+
+    if (chunk.error) std::rethrow_exception(chunk.error);
+
+    // If a statement crossed the end of its chunk the next
+    // chunks started in the middle of a statement:
+    if (chunk.rest > chunk.end) {
+      compile_range(text, chunk.rest, end, vars, delim, scope, this);
+      return;
+    }
+  }
+}
+
+void script::compile_file(const std::string& path, TokenMap vars,
+                          const char* delim, unsigned threads) {
+  fileView_t file(path, true);
+  compile(file.data(), vars, delim, threads);
+}
+
+packToken script::eval(TokenMap vars) const {
+  packToken last;
+  for (const statement_t& statement : _statements) {
+    last = eval(statement, vars);
+  }
+  return last;
+}
+
+packToken script::eval(const statement_t& statement, TokenMap vars) const {
+  const TokenMap* bound = statement.scope ? &scopes[statement.scope - 1] : 0;
+  return calculator::eval(tokens.data() + statement.begin,
+                          tokens.data() + statement.end, vars, config, bound);
+}
+
+/* * * * * Binary format * * * * */
+
+// Layout of version 1, all integers are little-endian:
+//
+// - "CPSC" magic number and the uint32 format version.
+// - uint64 number of statements, each saved as its uint64 offset
+//   followed by its RPN in the format of calculator::dump().
+
+namespace {
+
+const char MAGIC[] = "CPSC";
+const uint32_t FORMAT_VERSION = 1;
+
+}  // namespace
+
+std::string script::dump() const {
+  binaryWriter out;
+  out.bytes(MAGIC, 4);
+  out.u32(FORMAT_VERSION);
+  out.u64(_statements.size());
+  for (const statement_t& statement : _statements) {
+    out.u64(statement.offset);
+    std::string rpn = dump_rpn(tokens.data() + statement.begin,
+                               tokens.data() + statement.end);
+    out.bytes(rpn.data(), rpn.size());
+  }
+  return out.buffer;
+}
+
+size_t script::load(const char* data, size_t size, TokenMap builtins) {
+  binaryReader in(data, size);
+  in.header(MAGIC, FORMAT_VERSION, "script");
+
+  // Equal strings of different statements share their payload:
+  payloadPool_t payloads;
+
+  uint64_t n_statements = in.u64();
+  for (uint64_t i = 0; i < n_statements; ++i) {
+    statement_t statement;
+    statement.offset = in.u64();
+    statement.scope = 0;
+    statement.begin = tokens.size();
+    in.pos += load_rpn(data + in.pos, size - in.pos, builtins, &tokens,
+                       &payloads);
+    statement.end = tokens.size();
+    _statements.push_back(statement);
+  }
+
+  return in.pos;
+}
+
+void script::load_file(const std::string& path, TokenMap builtins) {
+  fileView_t file(path, false);
+  load(file.data(), file.size(), builtins);
+}
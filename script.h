@@ -0,0 +1,97 @@
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include <string>
+#include <vector>
+
+#include "./shunting-yard.h"
+
+// Compiles a text with several statements, e.g. a file with
+// one rule per line, into a list of statements.
+//
+// All statements are compiled with the same Config_t and the script
+// keeps a reference to it, so the config must outlive the script.
+class script {
+ public:
+  // A compiled statement, its RPN is kept on the script
+  // so it is evaluated with script::eval(statement, vars):
+  struct statement_t {
+    // Byte offset of the statement from the start of the text:
+    size_t offset;
+    // Position of its RPN on the script tokens:
+    size_t begin, end;
+    // With BIND_BY_REFERENCE the index + 1 of the
+    // `vars` used to compile it on the script, or 0:
+    uint32_t scope;
+  };
+
+ private:
+  const Config_t& config;
+  // The RPN of all statements, one after another:
+  std::vector<TokenBase*> tokens;
+  std::vector<statement_t> _statements;
+  std::vector<TokenMap> scopes;
+
+ public:
+  script(const Config_t& config = calculator::Default()) : config(config) {}
+  script(const script& other);
+  script(script&& other) noexcept;
+  ~script();
+  script& operator=(const script&) = delete;
+
+  // Compile all statements of a NUL terminated text, appending them
+  // to this script. Statements end on any of the `delim` characters
+  // outside of brackets and empty statements are skipped.
+  //
+  // If a statement is invalid the exception is propagated and the
+  // statements compiled before it are kept.
+  //
+  // With `threads` > 1 large texts are split on top-level statement
+  // boundaries and the chunks are compiled in parallel, `threads` = 0
+  // uses one thread per CPU core. The result is the same as with a
+  // single thread, so custom parsers must not depend on the order in
+  // which statements are compiled.
+  void compile(const char* text, TokenMap vars = &TokenMap::empty,
+               const char* delim = "\n;", unsigned threads = 1);
+
+  // Same as compile() but reads the text from a file.
+  //
+  // When possible the file is memory-mapped instead of copied.
+  void compile_file(const std::string& path, TokenMap vars = &TokenMap::empty,
+                    const char* delim = "\n;", unsigned threads = 1);
+
+  // Evaluate all statements in order and return the value of the last one:
+  packToken eval(TokenMap vars = &TokenMap::empty) const;
+  // Evaluate a single statement of this script:
+  packToken eval(const statement_t& statement,
+                 TokenMap vars = &TokenMap::empty) const;
+
+  // Save the compiled statements in a versioned binary format,
+  // see calculator::dump() for details.
+  std::string dump() const;
+
+  // Append the statements saved with dump() to this script
+  // and return the number of bytes read:
+  size_t load(const char* data, size_t size,
+              TokenMap builtins = &TokenMap::default_global());
+  void load_file(const std::string& path,
+                 TokenMap builtins = &TokenMap::default_global());
+
+ private:
+  // Compile the statements that start in [begin, end) into `output`
+  // and return the position where the last of them ended:
+  const char* compile_range(const char* text, const char* begin,
+                            const char* end, TokenMap vars, const char* delim,
+                            uint32_t scope, script* output) const;
+  void compile_parallel(const char* text, const char* end, TokenMap vars,
+                        const char* delim, uint32_t scope, unsigned threads);
+  // Move the statements of `other` to the end of this script:
+  void append(script* other);
+
+ public:
+  const std::vector<statement_t>& statements() const { return _statements; }
+  size_t size() const { return _statements.size(); }
+  const statement_t& operator[](size_t i) const { return _statements[i]; }
+};
+
+#endif  // SCRIPT_H_
@@ -0,0 +1,393 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+
+#include "./shunting-yard.h"
+#include "./serialization.h"
+
+/* * * * * Binary format of compiled calculators * * * * */
+
+// Layout of version 1, all integers are little-endian:
+//
+// - "CPRN" magic number and the uint32 format version.
+// - uint32 number of interned strings, each as a uint32 size
+//   followed by its bytes. Variable names, operators, string
+//   literals and function names are all kept on this pool.
+// - uint32 number of tokens followed by the tokens in RPN order.
+//
+// Each token starts with its tokType_t byte followed by:
+//
+// - NONE, UNARY: nothing.
+// - OP, VAR, STR: uint32 index on the string pool.
+// - REAL, INT: 8 bytes, BOOL: 1 byte.
+// - FUNC: a byte with a funcKind and a uint32 string index.
+// - LIST, TUPLE, STUPLE: uint32 size followed by the items.
+// - NUM_ARRAY: uint32 size followed by the items as 8 byte reals.
+// - MAP: uint32 size followed by pairs of a string index and a token,
+//   the parent of the map is not saved.
+// - REF: the key, the value and the origin of the reference as tokens.
+//
+// Tokens nested more than MAX_NESTING levels deep are rejected on load.
+
+namespace {
+
+const char MAGIC[] = "CPRN";
+const uint32_t FORMAT_VERSION = 1;
+
+// Loading is recursive, so the nesting is limited
+// to keep corrupted data from exhausting the stack:
+const uint32_t MAX_NESTING = 256;
+
+// How FUNC tokens are restored:
+enum funcKind {
+  FUNC_BY_NAME = 0,     // Looked up on the builtins scope.
+  FUNC_LIST_CTOR = 1,   // The list constructor used by `[1, 2]`.
+  FUNC_MAP_CTOR = 2     // The map constructor used by `{a: 1}`.
+};
+
+class rpnWriter {
+  binaryWriter tokens;
+  std::map<std::string, uint32_t> strings;
+  std::vector<const std::string*> pool;
+
+ public:
+  void string(const std::string& str) {
+    auto it = strings.find(str);
+    if (it == strings.end()) {
+      it = strings.insert(std::make_pair(str, pool.size())).first;
+      pool.push_back(&it->first);
+    }
+    tokens.u32(it->second);
+  }
+
+  void token(const TokenBase* base) {
+    tokType_t type = base->type;
+    if (type & REF) type = REF;
+    tokens.u8(type);
+
+    switch (type) {
+    case NONE:
+    case UNARY:
+      break;
+    case OP:
+    case VAR:
+    case STR:
+      string(static_cast<const Token<std::string>*>(base)->value());
+      break;
+    case REAL: {
+      double value = static_cast<const Token<double>*>(base)->val;
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      tokens.u64(bits);
+      break;
+    }
+    case INT:
+      tokens.u64(static_cast<const Token<int64_t>*>(base)->val);
+      break;
+    case BOOL:
+      tokens.u8(static_cast<const Token<uint8_t>*>(base)->val);
+      break;
+    case FUNC: {
+      const CppFunction* func = dynamic_cast<const CppFunction*>(base);
+      if (func && !func->isStdFunc &&
+          func->func == &TokenList::default_constructor) {
+        tokens.u8(FUNC_LIST_CTOR);
+        string("list");
+      } else if (func && !func->isStdFunc &&
+                 func->func == &TokenMap::default_constructor) {
+        tokens.u8(FUNC_MAP_CTOR);
+        string("map");
+      } else {
+        std::string name = static_cast<const Function*>(base)->name();
+        if (name.empty()) {
+          throw std::invalid_argument("Cannot serialize anonymous functions!");
+        }
+        tokens.u8(FUNC_BY_NAME);
+        string(name);
+      }
+      break;
+    }
+    case LIST:
+    case TUPLE:
+    case STUPLE: {
+      const TokenList_t& list = static_cast<const TokenList*>(base)->items();
+      tokens.u32(list.size());
+      for (const packToken& item : list) token(item.token());
+      break;
+    }
+    case NUM_ARRAY: {
+      const NumArray_t& array = static_cast<const NumArray*>(base)->array();
+      tokens.u32(array.size());
+      for (double value : array) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        tokens.u64(bits);
+      }
+      break;
+    }
+    case MAP: {
+      const TokenMap_t& map = static_cast<const TokenMap*>(base)->map();
+      tokens.u32(map.size());
+      for (const auto& item : map) {
+        string(item.first);
+        token(item.second.token());
+      }
+      break;
+    }
+    case REF: {
+      const RefToken* ref = static_cast<const RefToken*>(base);
+      packToken value(ref->resolve());
+      token(ref->key.token());
+      token(value.token());
+      token(ref->origin.token());
+      break;
+    }
+    default:
+      throw std::invalid_argument("Cannot serialize tokens of type: " +
+                                  std::to_string(base->type) + "!");
+    }
+  }
+
+  std::string result(uint32_t n_tokens) const {
+    binaryWriter out;
+    out.bytes(MAGIC, 4);
+    out.u32(FORMAT_VERSION);
+    out.u32(pool.size());
+    for (const std::string* str : pool) {
+      out.u32(str->size());
+      out.bytes(str->data(), str->size());
+    }
+    out.u32(n_tokens);
+    out.bytes(tokens.buffer.data(), tokens.buffer.size());
+    return out.buffer;
+  }
+};
+
+class rpnReader {
+  binaryReader& in;
+  TokenMap builtins;
+  // The strings are read directly from the input data:
+  std::vector<std::pair<const char*, uint32_t>> pool;
+  // Copied once on first use and shared by the string tokens:
+  std::vector<std::shared_ptr<std::string>> payloads;
+  // Shared with other readers, if any:
+  payloadPool_t* shared;
+  uint32_t depth = 0;
+
+ public:
+  rpnReader(binaryReader& in, TokenMap builtins, payloadPool_t* shared)
+           : in(in), builtins(builtins), shared(shared) {
+    uint32_t n_strings = in.u32();
+    pool.reserve(n_strings);
+    for (uint32_t i = 0; i < n_strings; ++i) {
+      uint32_t size = in.u32();
+      pool.push_back(std::make_pair(in.bytes(size), size));
+    }
+    payloads.resize(n_strings);
+  }
+
+  uint32_t string_index() {
+    uint32_t i = in.u32();
+    if (i >= pool.size()) {
+      throw std::invalid_argument("Invalid string index on binary data!");
+    }
+    return i;
+  }
+
+  std::string string() {
+    uint32_t i = string_index();
+    return std::string(pool[i].first, pool[i].second);
+  }
+
+  std::shared_ptr<std::string> shared_string() {
+    uint32_t i = string_index();
+    if (!payloads[i]) {
+      if (shared) {
+        payloads[i] = shared->get(pool[i].first, pool[i].second);
+      } else {
+        payloads[i] = std::make_shared<std::string>(pool[i].first, pool[i].second);
+      }
+    }
+    return payloads[i];
+  }
+
+  packToken token() {
+    if (depth == MAX_NESTING) {
+      throw std::invalid_argument("Tokens nested too deeply on binary data!");
+    }
+    ++depth;
+    packToken result = read_token();
+    --depth;
+    return result;
+  }
+
+ private:
+  packToken read_token() {
+    tokType_t type = in.u8();
+    switch (type) {
+    case NONE:
+      return packToken::None();
+    case UNARY:
+      return packToken(new TokenUnary());
+    case VAR:
+      return packToken(new Token<std::string>(atom_t(string()), VAR));
+    case OP:
+    case STR:
+      return packToken(new Token<std::string>(shared_string(), type));
+    case REAL: {
+      uint64_t bits = in.u64();
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      return packToken(value);
+    }
+    case INT:
+      return packToken(static_cast<int64_t>(in.u64()));
+    case BOOL:
+      return packToken(static_cast<bool>(in.u8()));
+    case FUNC: {
+      uint8_t kind = in.u8();
+      std::string name = string();
+      if (kind == FUNC_LIST_CTOR) {
+        return CppFunction(&TokenList::default_constructor, name);
+      } else if (kind == FUNC_MAP_CTOR) {
+        return CppFunction(&TokenMap::default_constructor, name);
+      }
+
+      packToken* func = builtins.find(name);
+      if (!func || (*func)->type != FUNC) {
+        throw std::invalid_argument("Undefined builtin function: `" + name + "`!");
+      }
+      return *func;
+    }
+    case LIST:
+    case TUPLE:
+    case STUPLE: {
+      TokenList* list;
+      if (type == TUPLE) {
+        list = new Tuple();
+      } else if (type == STUPLE) {
+        list = new STuple();
+      } else {
+        list = new TokenList();
+      }
+
+      packToken result(list);
+      uint32_t size = in.u32();
+      for (uint32_t i = 0; i < size; ++i) list->push(token());
+      return result;
+    }
+    case NUM_ARRAY: {
+      uint32_t size = in.u32();
+      NumArray array;
+      for (uint32_t i = 0; i < size; ++i) {
+        uint64_t bits = in.u64();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        array.array().push_back(value);
+      }
+      return array;
+    }
+    case MAP: {
+      TokenMap map;
+      uint32_t size = in.u32();
+      for (uint32_t i = 0; i < size; ++i) {
+        std::string key = string();
+        map[key] = token();
+      }
+      return map;
+    }
+    case REF: {
+      packToken key = token();
+      packToken value = token();
+      packToken origin = token();
+      return packToken(new RefToken(std::move(key), std::move(value),
+                                    std::move(origin)));
+    }
+    default:
+      throw std::invalid_argument("Invalid token type on binary data: " +
+                                  std::to_string(type) + "!");
+    }
+  }
+};
+
+}  // namespace
+
+// FNV-1a, the keys are usually short names and literals:
+size_t payloadPool_t::hash_t::operator()(const key_t& key) const {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < key.size; ++i) {
+    hash = (hash ^ static_cast<unsigned char>(key.data[i])) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::shared_ptr<std::string> payloadPool_t::get(const char* data, size_t size) {
+  auto it = payloads.find(key_t{data, size});
+  if (it != payloads.end()) return it->second;
+
+  // The key points to the payload, which the pool keeps shared
+  // so mutable_value() copies it instead of writing to it:
+  std::shared_ptr<std::string> payload = std::make_shared<std::string>(data, size);
+  payloads.emplace(key_t{payload->data(), size}, payload);
+  return payload;
+}
+
+std::string dump_rpn(TokenBase* const* first, TokenBase* const* last) {
+  rpnWriter writer;
+  for (TokenBase* const* it = first; it != last; ++it) {
+    writer.token(*it);
+  }
+  return writer.result(last - first);
+}
+
+size_t load_rpn(const char* data, size_t size, TokenMap builtins,
+                std::vector<TokenBase*>* rpn, payloadPool_t* payloads) {
+  binaryReader in(data, size);
+  in.header(MAGIC, FORMAT_VERSION, "calculator");
+
+  rpnReader reader(in, builtins, payloads);
+  size_t start = rpn->size();
+  try {
+    uint32_t n_tokens = in.u32();
+    if (n_tokens == 0) {
+      throw std::invalid_argument("Compiled calculator has no tokens!");
+    }
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+      packToken token = reader.token();
+      rpn->push_back(0);
+      rpn->back() = std::move(token).release();
+    }
+  } catch (...) {
+    for (size_t i = start; i < rpn->size(); ++i) delete (*rpn)[i];
+    rpn->resize(start);
+    throw;
+  }
+
+  return in.pos;
+}
+
+std::string calculator::dump() const {
+  rpnWriter writer;
+  TokenQueue_t rpn = this->RPN;
+  uint32_t n_tokens = rpn.size();
+
+  while (!rpn.empty()) {
+    writer.token(rpn.front());
+    rpn.pop();
+  }
+
+  return writer.result(n_tokens);
+}
+
+size_t calculator::load(const char* data, size_t size, TokenMap builtins) {
+  std::vector<TokenBase*> tokens;
+  size_t read = load_rpn(data, size, builtins, &tokens);
+
+  rpnBuilder::cleanRPN(&this->RPN);
+  this->RPN = TokenQueue_t(TokenQueue_t::container_type(tokens.begin(),
+                                                        tokens.end()));
+  this->bound_vars.reset();
+  return read;
+}
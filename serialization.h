@@ -0,0 +1,115 @@
+#ifndef SERIALIZATION_H_
+#define SERIALIZATION_H_
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "./shunting-yard.h"
+
+// Helpers for the binary formats of calculator::dump() and script::dump().
+//
+// All integers are written in little-endian byte order
+// so the files can be shared between machines.
+
+struct binaryWriter {
+  std::string buffer;
+
+  void u8(uint8_t value) { buffer.push_back(static_cast<char>(value)); }
+
+  void u32(uint32_t value) {
+    for (int i = 0; i < 4; ++i) u8(value >> (8*i));
+  }
+
+  void u64(uint64_t value) {
+    for (int i = 0; i < 8; ++i) u8(value >> (8*i));
+  }
+
+  void bytes(const char* data, size_t size) { buffer.append(data, size); }
+};
+
+// Reads directly from the input memory, e.g. a memory-mapped file,
+// throwing std::invalid_argument if it ends before expected.
+struct binaryReader {
+  const char* data;
+  size_t size;
+  size_t pos = 0;
+
+  binaryReader(const char* data, size_t size) : data(data), size(size) {}
+
+  const char* bytes(size_t n) {
+    if (size - pos < n) {
+      throw std::invalid_argument("Unexpected end of binary data!");
+    }
+    const char* start = data + pos;
+    pos += n;
+    return start;
+  }
+
+  uint8_t u8() { return static_cast<uint8_t>(*bytes(1)); }
+
+  uint32_t u32() {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(bytes(4));
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) value = (value << 8) | p[i];
+    return value;
+  }
+
+  uint64_t u64() {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(bytes(8));
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) value = (value << 8) | p[i];
+    return value;
+  }
+
+  // Check the 4 bytes magic number and the format version:
+  void header(const char* magic, uint32_t version, const char* what) {
+    if (memcmp(bytes(4), magic, 4) != 0) {
+      throw std::invalid_argument(std::string("Not a compiled ") + what + "!");
+    }
+    uint32_t found = u32();
+    if (found != version) {
+      throw std::invalid_argument(
+          std::string("Unsupported compiled ") + what + " version: " +
+          std::to_string(found) + "!");
+    }
+  }
+};
+
+// Shares the string payloads of several load_rpn() calls, e.g. of all
+// statements of a script, so equal strings are only copied once.
+// It must not outlive the loads, after them the tokens may write
+// to the payloads they no longer share.
+class payloadPool_t {
+  struct key_t {
+    const char* data;
+    size_t size;
+
+    bool operator==(const key_t& other) const {
+      return size == other.size && memcmp(data, other.data, size) == 0;
+    }
+  };
+
+  struct hash_t {
+    size_t operator()(const key_t& key) const;
+  };
+
+  std::unordered_map<key_t, std::shared_ptr<std::string>, hash_t> payloads;
+
+ public:
+  std::shared_ptr<std::string> get(const char* data, size_t size);
+};
+
+// Save the tokens in [first, last) in the format of calculator::dump():
+std::string dump_rpn(TokenBase* const* first, TokenBase* const* last);
+
+// Append the tokens saved with dump_rpn() to `rpn` and return
+// the number of bytes read, on errors `rpn` is left unchanged:
+size_t load_rpn(const char* data, size_t size, TokenMap builtins,
+                std::vector<TokenBase*>* rpn, payloadPool_t* payloads = 0);
+
+#endif  // SERIALIZATION_H_
@@ -30,6 +30,10 @@ struct type_error : public msg_exception {
   type_error(const std::string& msg) : msg_exception(msg) {}
 };
 
+struct budget_exceeded : public msg_exception {
+  budget_exceeded(const std::string& msg) : msg_exception(msg) {}
+};
+
 struct undefined_operation : public msg_exception {
   undefined_operation(const std::string& op, const TokenBase* left, const TokenBase* right)
                       : undefined_operation(op, packToken(left->clone()), packToken(right->clone())) {}
@@ -9,7 +9,16 @@
 #include <string>
 #include <stack>
 #include <utility>  // For std::pair
-#include <cstring>  // For strchr()
+#include <cstring>  // For strchr(), strnlen() and memcpy()
+#include <cstdint>
+#include <clocale>  // For newlocale() and strtod_l()
+#if defined(__APPLE__)
+#include <xlocale.h>
+#endif
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 /* * * * * Operation class: * * * * */
 
@@ -44,7 +53,10 @@ TokenBase* exec_operation(const packToken& left, const packToken& right,
   for (const Operation& operation : it->second) {
     if (match_op_id(data->opID, operation.getMask())) {
       try {
-        return operation.exec(left, right, data).release();
+        TokenBase* result = operation.exec(left, right, data).release();
+        if (!data->rejected) return result;
+        data->rejected = false;
+        delete result;
       } catch (const Operation::Reject& e) {
         continue;
       }
@@ -95,6 +107,330 @@ typeMap_t& calculator::type_attribute_map() {
 
 /* * * * * rpnBuilder Class: * * * * */
 
+#define S_ CC_SPACE
+#define D_ CC_DIGIT
+#define A_ CC_ALPHA
+#define P_ CC_PUNCT
+#define O_ (CC_PUNCT | CC_OPCHAR)
+#define AP (CC_ALPHA | CC_PUNCT)
+#define U_ CC_UTF8
+const uint8_t rpnBuilder::charClasses[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, S_, S_, S_, S_, S_, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  S_, O_, P_, O_, O_, O_, O_, P_, P_, P_, O_, P_, O_, P_, O_, O_,
+  D_, D_, D_, D_, D_, D_, D_, D_, D_, D_, O_, O_, O_, O_, O_, O_,
+  O_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_,
+  A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, P_, O_, P_, O_, AP,
+  O_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_,
+  A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, A_, P_, O_, P_, O_, 0,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+  U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_, U_,
+};
+#undef S_
+#undef D_
+#undef A_
+#undef P_
+#undef O_
+#undef AP
+#undef U_
+
+// SWAR helpers (SIMD Within A Register) used to classify 8 bytes at once.
+//
+// Note: Words are only loaded where strnlen() found no '\0', so the
+// scanners never read past the end of the expression.
+namespace {
+
+const uint64_t ONES = 0x0101010101010101ULL;
+const uint64_t HIGHS = 0x8080808080808080ULL;
+
+inline uint64_t load_word(const char* p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+// Set the high bit of every byte `b` of x such that m < b < n.
+// Bytes with the high bit set (non-ASCII) are never selected.
+inline uint64_t bytes_between(uint64_t x, uint8_t m, uint8_t n) {
+  uint64_t low = x & (ONES * 127);
+  return (ONES * (127 + n) - low) & ~x & (low + ONES * (127 - m)) & HIGHS;
+}
+
+// True if all 8 bytes are ASCII letters, digits or '_':
+inline bool is_var_word(uint64_t x) {
+  uint64_t match = bytes_between(x, '0' - 1, '9' + 1) |
+                   bytes_between(x, 'A' - 1, 'Z' + 1) |
+                   bytes_between(x, 'a' - 1, 'z' + 1) |
+                   bytes_between(x, '_' - 1, '_' + 1);
+  return match == HIGHS;
+}
+
+// True if all 8 bytes are whitespace characters:
+inline bool is_space_word(uint64_t x) {
+  uint64_t match = bytes_between(x, '\t' - 1, '\r' + 1) |
+                   bytes_between(x, ' ' - 1, ' ' + 1);
+  return match == HIGHS;
+}
+
+inline bool is_aligned(const char* p) {
+  return (reinterpret_cast<uintptr_t>(p) & (sizeof(uint64_t) - 1)) == 0;
+}
+
+// Bytes checked by each strnlen() call, so a short token
+// doesn't look for the end of the whole buffer:
+const size_t SCAN_AHEAD = 64;
+
+// Skip the whole words of `expr` that match, expr must be aligned:
+template <bool (*match)(uint64_t)>
+inline const char* skip_words(const char* expr) {
+  while (true) {
+    const char* end = expr + strnlen(expr, SCAN_AHEAD);
+    while (end - expr >= 8 && match(load_word(expr))) expr += sizeof(uint64_t);
+
+    // Continue only if every readable word matched and the text goes on:
+    if (end - expr >= 8 || !*end) return expr;
+  }
+}
+
+}  // namespace
+
+unsigned char rpnBuilder::UTF8charSize(const char* str) {
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(str);
+  unsigned char size;
+  unsigned char min = 0x80, max = 0xBF;
+
+  // Valid sequences as described on RFC 3629, section 4:
+  if (s[0] < 0x80) {
+    return 1;
+  } else if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    size = 2;
+  } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    size = 3;
+    // Reject overlong encodings and UTF-16 surrogates:
+    if (s[0] == 0xE0) min = 0xA0;
+    if (s[0] == 0xED) max = 0x9F;
+  } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    size = 4;
+    // Reject overlong encodings and code points above U+10FFFF:
+    if (s[0] == 0xF0) min = 0x90;
+    if (s[0] == 0xF4) max = 0x8F;
+  } else {
+    throw std::domain_error("Invalid first byte on UTF8 character");
+  }
+
+  if (s[1] < min || s[1] > max) {
+    throw std::domain_error("Subsequent bytes of unicode character have to be of the form \\b10xxxxxx");
+  }
+
+  for (unsigned char i = 2; i < size; ++i) {
+    if ((s[i] & 0xC0) != 0x80) {
+      throw std::domain_error("Subsequent bytes of unicode character have to be of the form \\b10xxxxxx");
+    }
+  }
+
+  return size;
+}
+
+const char* rpnBuilder::skipVar(const char* expr) {
+  while (true) {
+    // Skip ASCII characters one at a time until aligned:
+    while (!is_aligned(expr) && (charClass(*expr) & (CC_ALPHA | CC_DIGIT))) {
+      ++expr;
+    }
+
+    // Then skip whole words of ASCII characters:
+    if (is_aligned(expr)) {
+      expr = skip_words<is_var_word>(expr);
+      while (charClass(*expr) & (CC_ALPHA | CC_DIGIT)) ++expr;
+    }
+
+    if (charClass(*expr) & CC_UTF8) {
+      expr += UTF8charSize(expr);
+    } else if (!(charClass(*expr) & (CC_ALPHA | CC_DIGIT))) {
+      return expr;
+    }
+  }
+}
+
+namespace {
+
+// Powers of 10 that are exactly representable as doubles:
+const double exact_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+  1e21, 1e22
+};
+
+inline int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Parse the digits of a hexadecimal or binary literal,
+// `expr` should point to the first digit after the prefix:
+int64_t parse_radix(const char* expr, const char** rest, unsigned radix) {
+  uint64_t value = 0;
+  int digit;
+  while ((digit = hex_value(*expr)) >= 0 && digit < static_cast<int>(radix)) {
+    if (value > (UINT64_MAX - digit) / radix) {
+      throw syntax_error("Integer literal is too large!");
+    }
+    value = value * radix + digit;
+    ++expr;
+
+    // Accept underscores between digits, e.g.: 0xFFFF_FFFF
+    if (*expr == '_') {
+      digit = hex_value(expr[1]);
+      if (digit >= 0 && digit < static_cast<int>(radix)) ++expr;
+    }
+  }
+  *rest = expr;
+
+  // Literals with the 64th bit set are wrapped around, e.g. 0xFFFFFFFFFFFFFFFF == -1
+  return static_cast<int64_t>(value);
+}
+
+// Skip a sequence of decimal digits optionally separated by single underscores.
+// Up to 19 significant digits are accumulated on `mantissa`, the number of
+// digits appended to it is returned on `kept` and the ignored ones on `dropped`.
+const char* scan_digits(const char* expr, uint64_t* mantissa, int* n_digits,
+                        int* kept, int* dropped) {
+  *kept = *dropped = 0;
+  while (rpnBuilder::charClass(*expr) & CC_DIGIT) {
+    if (*n_digits < 19) {
+      *mantissa = *mantissa * 10 + (*expr - '0');
+      if (*mantissa) ++(*n_digits);
+      ++(*kept);
+    } else {
+      ++(*dropped);
+    }
+    ++expr;
+
+    if (*expr == '_' && (rpnBuilder::charClass(expr[1]) & CC_DIGIT)) ++expr;
+  }
+  return expr;
+}
+
+// Literals always use a '.', whatever locale the host sets,
+// so they are converted with the "C" locale:
+#if defined(_WIN32)
+const _locale_t c_locale = _create_locale(LC_NUMERIC, "C");
+double c_strtod(const char* str) { return _strtod_l(str, 0, c_locale); }
+#else
+const locale_t c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+double c_strtod(const char* str) { return strtod_l(str, 0, c_locale); }
+#endif
+
+// Slow path for the rare literals that can't be converted exactly
+// by the fast path:
+double parse_real(const char* start, const char* end) {
+  std::string literal;
+  for (; start != end; ++start) {
+    if (*start != '_') literal.push_back(*start);
+  }
+
+  return c_strtod(literal.c_str());
+}
+
+}  // namespace
+
+TokenBase* rpnBuilder::parseNumber(const char* expr, const char** rest) {
+  const char* start = expr;
+
+  // Hexadecimal and binary literals:
+  if (expr[0] == '0' && (expr[1] == 'x' || expr[1] == 'X') &&
+      hex_value(expr[2]) >= 0) {
+    return new Token<int64_t>(parse_radix(expr + 2, rest, 16), INT);
+  }
+  if (expr[0] == '0' && (expr[1] == 'b' || expr[1] == 'B') &&
+      (expr[2] == '0' || expr[2] == '1')) {
+    return new Token<int64_t>(parse_radix(expr + 2, rest, 2), INT);
+  }
+
+  // Decimal literals are read in a single pass
+  // accumulating up to 19 significant digits:
+  uint64_t mantissa = 0;
+  int n_digits = 0, kept, dropped;
+  int exp10 = 0;
+  bool is_real = false;
+
+  expr = scan_digits(expr, &mantissa, &n_digits, &kept, &dropped);
+  // Each ignored digit multiplies the mantissa by 10:
+  exp10 += dropped;
+  bool fits_int = (dropped == 0);
+
+  if (*expr == '.') {
+    is_real = true;
+    expr = scan_digits(expr + 1, &mantissa, &n_digits, &kept, &dropped);
+    // Each fraction digit appended to the mantissa divides it by 10:
+    exp10 -= kept;
+  }
+
+  if (*expr == 'e' || *expr == 'E') {
+    const char* e = expr + 1;
+    bool negative = (*e == '-');
+    if (*e == '+' || *e == '-') ++e;
+
+    // Only consume the exponent if it has at least one digit:
+    if (charClass(*e) & CC_DIGIT) {
+      int exponent = 0;
+      while (charClass(*e) & CC_DIGIT) {
+        if (exponent < 100000) exponent = exponent * 10 + (*e - '0');
+        ++e;
+      }
+      exp10 += negative ? -exponent : exponent;
+      is_real = true;
+      expr = e;
+    }
+  }
+
+  *rest = expr;
+
+  if (!is_real) {
+    if (fits_int && mantissa <= static_cast<uint64_t>(INT64_MAX)) {
+      return new Token<int64_t>(static_cast<int64_t>(mantissa), INT);
+    }
+    // Integers that don't fit on an int64_t are converted to real numbers:
+  }
+
+  // Fast path: Both the mantissa and the power of 10
+  // are exact so a single operation rounds correctly:
+  if (mantissa < (uint64_t(1) << 53) && exp10 >= -22 && exp10 <= 22) {
+    double value = static_cast<double>(mantissa);
+    if (exp10 < 0) {
+      value /= exact_pow10[-exp10];
+    } else {
+      value *= exact_pow10[exp10];
+    }
+    return new Token<double>(value, REAL);
+  }
+
+  return new Token<double>(parse_real(start, expr), REAL);
+}
+
+const char* rpnBuilder::skipSpaces(const char* expr, const charSet_t& delim) {
+  // If a whitespace character is a delimiter check them one by one:
+  if (delim.spaces) {
+    while ((charClass(*expr) & CC_SPACE) && !delim.has(*expr)) ++expr;
+    return expr;
+  }
+
+  while (!is_aligned(expr) && (charClass(*expr) & CC_SPACE)) ++expr;
+  if (is_aligned(expr)) {
+    expr = skip_words<is_space_word>(expr);
+    while (charClass(*expr) & CC_SPACE) ++expr;
+  }
+  return expr;
+}
+
 void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
   while (rpn->size()) {
     delete resolve_reference(rpn->front());
@@ -102,6 +438,163 @@ void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
   }
 }
 
+uint64_t new_version_stamp() {
+  static std::atomic<uint64_t> counter(0);
+  return ++counter;
+}
+
+/* * * * * lexicon_t class: * * * * */
+
+// Node 0 is a sentinel, so a child index of 0 means "not found":
+uint32_t lexicon_t::child(uint32_t node, char c) const {
+  for (const auto& edge : nodes[node].children) {
+    if (edge.first == c) return edge.second;
+  }
+  return 0;
+}
+
+lexicon_t::entry_t* lexicon_t::insert(const std::string& key) {
+  uint32_t& first = root[static_cast<unsigned char>(key[0])];
+  if (!first) {
+    first = nodes.size();
+    nodes.emplace_back();
+  }
+
+  uint32_t node = first;
+  for (size_t i = 1; i < key.size(); ++i) {
+    uint32_t next = child(node, key[i]);
+    if (!next) {
+      next = nodes.size();
+      nodes.emplace_back();
+      nodes[node].children.push_back(std::make_pair(key[i], next));
+    }
+    node = next;
+  }
+
+  if (nodes[node].entry < 0) {
+    nodes[node].entry = entries.size();
+    entries.emplace_back();
+    entries.back().key = key;
+  }
+
+  return &entries[nodes[node].entry];
+}
+
+lexicon_t::lexicon_t(const parserMap_t& parser, const OppMap_t& opp)
+                    : nodes(1), root(), char_parsers(),
+                      parser_version(parser.version()),
+                      opp_version(opp.version()) {
+  for (const auto& op : opp.pr_map) {
+    if (op.first.empty()) continue;
+    entry_t* entry = insert(op.first);
+    entry->is_op = true;
+    entry->prec = op.second;
+    entry->rtol = opp.RtoL.count(op.first);
+    entry->name = normalize_op(op.first);
+    entry->atom = atom_t(entry->name);
+  }
+
+  for (const auto& word : parser.wmap) {
+    if (word.first.empty()) continue;
+    insert(word.first)->parser = word.second;
+  }
+
+  for (const auto& c : parser.cmap) {
+    char_parsers[static_cast<unsigned char>(c.first)] = c.second;
+  }
+
+  // Link each operator to its unary versions, now
+  // that the entries vector won't be resized anymore:
+  for (entry_t& entry : entries) {
+    if (!entry.is_op) continue;
+    const entry_t* left = find("L" + entry.key);
+    const entry_t* right = find("R" + entry.key);
+    if (left && left->is_op) entry.left = left;
+    if (right && right->is_op) entry.right = right;
+  }
+}
+
+const lexicon_t::entry_t* lexicon_t::find(const char* begin,
+                                          const char* end) const {
+  if (begin == end) return 0;
+
+  uint32_t node = root[static_cast<unsigned char>(*begin)];
+  while (node && ++begin != end) {
+    node = child(node, *begin);
+  }
+
+  if (!node || nodes[node].entry < 0) return 0;
+  return &entries[nodes[node].entry];
+}
+
+const lexicon_t::entry_t* lexicon_t::longest_match(const char* begin,
+                                                   const char* end,
+                                                   const char** match_end) const {
+  const entry_t* match = 0;
+  if (begin == end) return 0;
+
+  uint32_t node = root[static_cast<unsigned char>(*begin)];
+  for (const char* p = begin+1; node; ++p) {
+    if (nodes[node].entry >= 0) {
+      const entry_t* entry = &entries[nodes[node].entry];
+      if (entry->parser || entry->is_op) {
+        match = entry;
+        *match_end = p;
+      }
+    }
+    if (p == end) break;
+    node = child(node, *p);
+  }
+
+  return match;
+}
+
+int lexicon_t::prec(const std::string& key) const {
+  const entry_t* entry = find(key);
+  if (!entry || !entry->is_op) {
+    throw std::out_of_range("Undefined operator: `" + key + "`!");
+  }
+  return entry->prec;
+}
+
+std::shared_ptr<const lexicon_t> Config_t::lexicon() const {
+  std::shared_ptr<lexiconSlot_t> slot = std::atomic_load(&_lexicon);
+  std::shared_ptr<const lexicon_t> lex = std::atomic_load(slot.get());
+  if (lex && !lex->outdated(parserMap, opPrecedence)) return lex;
+
+  std::shared_ptr<const lexicon_t> fresh =
+      std::make_shared<const lexicon_t>(parserMap, opPrecedence);
+
+  if (lex) {
+    // This config was changed, so stop sharing
+    // the lexicon with the copies it was made from:
+    std::atomic_store(&_lexicon, std::make_shared<lexiconSlot_t>(fresh));
+  } else {
+    std::atomic_store(slot.get(), fresh);
+  }
+
+  return fresh;
+}
+
+rpnBuilder::rpnBuilder(TokenMap scope, const OppMap_t& opp)
+                      : scope(scope), opp(opp),
+                        lex(std::make_shared<const lexicon_t>(parserMap_t(), opp)) {}
+
+rpnBuilder::rpnBuilder(TokenMap scope, const Config_t& config)
+                      : scope(scope), opp(config.opPrecedence),
+                        lex(config.lexicon()) {}
+
+// Move the operator on the top of the op stack into the RPN:
+void rpnBuilder::pop_op() {
+  const lexicon_t::entry_t* entry = lex->find(opStack.top());
+  if (entry && entry->is_op) {
+    rpn.push(new Token<std::string>(entry->atom, OP));
+  } else {
+    rpn.push(new Token<std::string>(normalize_op(opStack.top()), OP));
+  }
+  opStack.pop();
+}
+
 /**
  * Consume operators with precedence >= than op
  * and add them to the RPN
@@ -118,68 +611,75 @@ void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
  *     pop o2 off the stack onto the output queue.
  *   Push o1 on the stack.
  */
-void rpnBuilder::handle_opStack(const std::string& op) {
-  std::string cur_op;
-
+void rpnBuilder::handle_opStack(const lexicon_t::entry_t* op) {
   // If it associates from left to right:
-  if (opp.assoc(op) == 0) {
-    while (!opStack.empty() &&
-        opp.prec(op) >= opp.prec(opStack.top())) {
-      cur_op = normalize_op(opStack.top());
-      rpn.push(new Token<std::string>(cur_op, OP));
-      opStack.pop();
+  if (op->rtol == false) {
+    while (!opStack.empty() && op->prec >= lex->prec(opStack.top())) {
+      pop_op();
     }
   } else {
-    while (!opStack.empty() &&
-        opp.prec(op) > opp.prec(opStack.top())) {
-      cur_op = normalize_op(opStack.top());
-      rpn.push(new Token<std::string>(cur_op, OP));
-      opStack.pop();
+    while (!opStack.empty() && op->prec > lex->prec(opStack.top())) {
+      pop_op();
     }
   }
 }
 
-void rpnBuilder::handle_binary(const std::string& op) {
+void rpnBuilder::handle_binary(const lexicon_t::entry_t* op) {
   // Handle OP precedence
   handle_opStack(op);
   // Then push the current op into the stack:
-  opStack.push(op);
+  opStack.push(op->key);
 }
 
 // Convert left unary operators to binary and handle them:
-void rpnBuilder::handle_left_unary(const std::string& unary_op) {
+void rpnBuilder::handle_left_unary(const lexicon_t::entry_t* unary_op) {
   this->rpn.push(new TokenUnary());
   // Only put it on the stack and wait to check op precedence:
-  opStack.push(unary_op);
+  opStack.push(unary_op->key);
 }
 
 // Convert right unary operators to binary and handle them:
-void rpnBuilder::handle_right_unary(const std::string& unary_op) {
+void rpnBuilder::handle_right_unary(const lexicon_t::entry_t* unary_op) {
   // Handle OP precedence:
   handle_opStack(unary_op);
   // Add the unary token:
   this->rpn.push(new TokenUnary());
   // Then add the current op directly into the rpn:
-  rpn.push(new Token<std::string>(normalize_op(unary_op), OP));
+  rpn.push(new Token<std::string>(unary_op->atom, OP));
 }
 
 // Find out if op is a binary or unary operator and handle it:
-void rpnBuilder::handle_op(const std::string& op) {
+bool rpnBuilder::try_handle_op(const std::string& op, calcError_t* error) {
+  const lexicon_t::entry_t* entry = lex->find(op);
+
+  if (entry && entry->is_op) {
+    return try_handle_op(entry, error);
+  } else if (this->lastTokenWasOp) {
+    error->set(calcError_t::DOMAIN_ERROR,
+               "Unrecognized unary operator: '", op, "'.");
+  } else {
+    error->set(calcError_t::DOMAIN_ERROR, "Undefined operator: `", op, "`!");
+  }
+  return false;
+}
+
+bool rpnBuilder::try_handle_op(const lexicon_t::entry_t* op,
+                               calcError_t* error) {
   // If its a left unary operator:
   if (this->lastTokenWasOp) {
-    if (opp.exists("L"+op)) {
-      handle_left_unary("L"+op);
+    if (op->left) {
+      handle_left_unary(op->left);
       this->lastTokenWasUnary = true;
-      this->lastTokenWasOp = op[0];
+      this->lastTokenWasOp = op->key[0];
     } else {
-      cleanRPN(&(this->rpn));
-      throw std::domain_error(
-          "Unrecognized unary operator: '" + op + "'.");
+      error->set(calcError_t::DOMAIN_ERROR,
+                 "Unrecognized unary operator: '", op->key, "'.");
+      return false;
     }
 
   // If its a right unary operator:
-  } else if (opp.exists("R"+op)) {
-    handle_right_unary("R"+op);
+  } else if (op->right) {
+    handle_right_unary(op->right);
 
     // Set it to false, since we have already added
     // an unary token and operand to the stack:
@@ -188,16 +688,27 @@ void rpnBuilder::handle_op(const std::string& op) {
 
   // If it is a binary operator:
   } else {
-    if (opp.exists(op)) {
-      handle_binary(op);
-    } else {
-      cleanRPN(&(rpn));
-      throw std::domain_error(
-          "Undefined operator: `" + op + "`!");
-    }
+    handle_binary(op);
 
     this->lastTokenWasUnary = false;
-    this->lastTokenWasOp = op[0];
+    this->lastTokenWasOp = op->key[0];
+  }
+  return true;
+}
+
+void rpnBuilder::handle_op(const std::string& op) {
+  calcError_t error;
+  if (!try_handle_op(op, &error)) {
+    cleanRPN(&rpn);
+    error.raise();
+  }
+}
+
+void rpnBuilder::handle_op(const lexicon_t::entry_t* op) {
+  calcError_t error;
+  if (!try_handle_op(op, &error)) {
+    cleanRPN(&rpn);
+    error.raise();
   }
 }
 
@@ -214,27 +725,153 @@ void rpnBuilder::open_bracket(const std::string& bracket) {
   ++bracketLevel;
 }
 
-void rpnBuilder::close_bracket(const std::string& bracket) {
+bool rpnBuilder::try_close_bracket(const std::string& bracket,
+                                   calcError_t* error) {
   if (lastTokenWasOp == bracket[0]) {
     rpn.push(new Tuple());
   }
 
-  std::string cur_op;
   while (opStack.size() && opStack.top() != bracket) {
-    cur_op = normalize_op(opStack.top());
-    rpn.push(new Token<std::string>(cur_op, OP));
-    opStack.pop();
+    pop_op();
   }
 
   if (opStack.size() == 0) {
-    rpnBuilder::cleanRPN(&rpn);
-    throw syntax_error("Extra '" + bracket + "' on the expression!");
+    error->set(calcError_t::SYNTAX_ERROR,
+               "Extra '", bracket, "' on the expression!");
+    return false;
   }
 
   opStack.pop();
   lastTokenWasOp = false;
   lastTokenWasUnary = false;
   --bracketLevel;
+  return true;
+}
+
+void rpnBuilder::close_bracket(const std::string& bracket) {
+  calcError_t error;
+  if (!try_close_bracket(bracket, &error)) {
+    cleanRPN(&rpn);
+    error.raise();
+  }
+}
+
+/* * * * * evalBudget_t struct * * * * */
+
+thread_local evalBudget_t* evalBudget_t::current = 0;
+
+evalBudget_t::scope_t::scope_t(evalBudget_t* budget) : budget(budget) {
+  if (budget) {
+    budget->parent = current;
+    current = budget;
+  }
+}
+
+evalBudget_t::scope_t::~scope_t() {
+  if (budget) current = budget->parent;
+}
+
+const char* evalBudget_t::exceeded() const {
+  if (max_steps && steps > max_steps) return "step";
+  if (max_tokens && tokens > max_tokens) return "token";
+  if (max_bytes && bytes > max_bytes) return "byte";
+  return 0;
+}
+
+const char* evalBudget_t::add_step() {
+  const char* limit = 0;
+  for (evalBudget_t* b = this; b; b = b->parent) {
+    ++b->steps;
+    if (!limit) limit = b->exceeded();
+  }
+  return limit;
+}
+
+void evalBudget_t::add_tokens() {
+  for (evalBudget_t* b = this; b; b = b->parent) ++b->tokens;
+}
+
+void evalBudget_t::add_bytes(size_t n) {
+  for (evalBudget_t* b = this; b; b = b->parent) b->bytes += n;
+  throw_if_exceeded();
+}
+
+const char* evalBudget_t::chain_exceeded() const {
+  for (const evalBudget_t* b = this; b; b = b->parent) {
+    if (const char* limit = b->exceeded()) return limit;
+  }
+  return 0;
+}
+
+void evalBudget_t::throw_if_exceeded() const {
+  if (const char* limit = chain_exceeded()) {
+    throw budget_exceeded(std::string("Evaluation exceeded its ") +
+                          limit + " budget.");
+  }
+}
+
+/* * * * * calcError_t struct * * * * */
+
+void calcError_t::set(code_t code, const char* prefix,
+                      std::string detail, const char* suffix) {
+  this->code = code;
+  this->prefix = prefix;
+  this->detail = std::move(detail);
+  this->suffix = suffix;
+}
+
+void calcError_t::set_undefined_operation(const std::string& op,
+                                          const packToken& left,
+                                          const packToken& right) {
+  set(UNDEFINED_OPERATION, "", op);
+  operands = std::make_shared<const std::pair<packToken, packToken>>(left, right);
+}
+
+void calcError_t::set_exception(std::exception_ptr exception, code_t code) {
+  set(code, "");
+  this->exception = exception;
+}
+
+std::string calcError_t::message() const {
+  if (exception) {
+    try {
+      std::rethrow_exception(exception);
+    } catch (const std::exception& e) {
+      return e.what();
+    } catch (...) {
+      return "Unknown exception";
+    }
+  }
+
+  switch (code) {
+  case OK:
+    return "";
+  case UNDEFINED_OPERATION:
+    return undefined_operation(detail, operands->first, operands->second).what();
+  default:
+    return prefix + detail + suffix;
+  }
+}
+
+void calcError_t::raise() const {
+  if (exception) std::rethrow_exception(exception);
+
+  switch (code) {
+  case OK:
+    throw std::logic_error("calcError_t::raise() called without an error!");
+  case SYNTAX_ERROR:
+    throw syntax_error(message());
+  case INVALID_ARGUMENT:
+    throw std::invalid_argument(message());
+  case DOMAIN_ERROR:
+    throw std::domain_error(message());
+  case UNDEFINED_OPERATION:
+    throw undefined_operation(detail, operands->first, operands->second);
+  case BUDGET_EXCEEDED:
+    throw budget_exceeded(message());
+  default:
+    throw std::logic_error("calcError_t::raise() called without an exception!");
+  }
 }
 
 /* * * * * RAII_TokenQueue_t struct  * * * * */
@@ -259,62 +896,102 @@ struct calculator::RAII_TokenQueue_t : TokenQueue_t {
 
 /* * * * * calculator class * * * * */
 
+namespace {
+
+// Used by toRPN() to discard the partial RPN on errors:
+void abort_rpn(rpnBuilder* data) {
+  rpnBuilder::cleanRPN(&data->rpn);
+}
+
+}  // namespace
+
 TokenQueue_t calculator::toRPN(const char* expr,
                                TokenMap vars, const char* delim,
-                               const char** rest, Config_t config) {
-  rpnBuilder data(vars, config.opPrecedence);
-  char* nextChar;
-
-  static char c = '\0';
-  if (!delim) delim = &c;
+                               const char** rest, const Config_t& config) {
+  calcError_t error;
+  TokenQueue_t rpn = toRPN(expr, vars, delim, rest, config, &error);
+  if (error) error.raise();
+  return rpn;
+}
 
-  while (*expr && isspace(*expr) && !strchr(delim, *expr)) ++expr;
+TokenQueue_t calculator::toRPN(const char* expr,
+                               TokenMap vars, const char* delim,
+                               const char** rest, const Config_t& config,
+                               calcError_t* error) {
+  rpnBuilder data(vars, config);
+  toRPN(&data, expr, charSet_t(delim), rest, config, error);
+  return std::move(data.rpn);
+}
 
-  if (*expr == '\0' || strchr(delim, *expr)) {
-    throw std::invalid_argument("Cannot build a calculator from an empty expression!");
+void calculator::toRPN(rpnBuilder* builder, const char* expr,
+                       const charSet_t& delims, const char** rest,
+                       const Config_t& config, calcError_t* error) {
+  rpnBuilder& data = *builder;
+  const lexicon_t& lex = *data.lex;
+  const charSet_t no_delims;
+
+  // Start over from the state left by the last expression:
+  data.opStack = std::stack<std::string>();
+  data.lastTokenWasOp = true;
+  data.lastTokenWasUnary = false;
+  data.bracketLevel = 0;
+
+  expr = rpnBuilder::skipSpaces(expr, delims);
+
+  if (delims.has(*expr)) {
+    error->set(calcError_t::INVALID_ARGUMENT,
+               "Cannot build a calculator from an empty expression!");
+    return;
   }
 
   // In one pass, ignore whitespace and parse the expression into RPN
   // using Dijkstra's Shunting-yard algorithm.
-  while (*expr && (data.bracketLevel || !strchr(delim, *expr))) {
-    if (isdigit(*expr)) {
+  while (*expr && (data.bracketLevel || !delims.has(*expr))) {
+    uint8_t cclass = rpnBuilder::charClass(*expr);
+    if (cclass & CC_DIGIT) {
       // If the token is a number, add it to the output queue.
-      int64_t _int = strtoll(expr, &nextChar, 10);
-
-      // If the number was not a float:
-      if (!strchr(".eE", *nextChar)) {
-        data.handle_token(new Token<int64_t>(_int, INT));
-      } else {
-        double digit = strtod(expr, &nextChar);
-        data.handle_token(new Token<double>(digit, REAL));
+      TokenBase* number;
+      try {
+        number = rpnBuilder::parseNumber(expr, &expr);
+      } catch (...) {
+        error->set_exception(std::current_exception());
+        return abort_rpn(&data);
       }
-
-      expr = nextChar;
-    } else if (rpnBuilder::isvarchar(*expr, &expr)) {
+      data.handle_token(number);
+    } else if (cclass & (CC_ALPHA | CC_UTF8)) {
       rWordParser_t* parser;
 
       // If the token is a variable, resolve it and
       // add the parsed number to the output queue.
-      std::string key = rpnBuilder::parseVar(expr, &expr);
+      std::string key;
+      try {
+        key = rpnBuilder::parseVar(expr, &expr);
+      } catch (...) {
+        error->set_exception(std::current_exception());
+        return abort_rpn(&data);
+      }
 
-      if ((parser=config.parserMap.find(key))) {
+      const lexicon_t::entry_t* word = lex.find(key);
+      if (word && (parser=word->parser)) {
         // Parse reserved words:
         try {
           parser(expr, &expr, &data);
         } catch (...) {
-          rpnBuilder::cleanRPN(&data.rpn);
-          throw;
+          error->set_exception(std::current_exception());
+          return abort_rpn(&data);
         }
       } else {
-        packToken* value = vars.find(key);
+        packToken* value = 0;
+        if (config.bindMode == BIND_BY_VALUE) value = data.scope.find(key);
 
         if (value) {
-          // Save a reference token:
+          // Save a reference token, its key shares the interned name:
           TokenBase* copy = (*value)->clone();
-          data.handle_token(new RefToken(key, copy));
+          packToken name(new Token<std::string>(atom_t(key), STR));
+          data.handle_token(new RefToken(std::move(name), copy));
         } else {
           // Save the variable name:
-          data.handle_token(new Token<std::string>(key, VAR));
+          data.handle_token(new Token<std::string>(atom_t(key), VAR));
         }
       }
     } else if (*expr == '\'' || *expr == '"') {
@@ -323,37 +1000,42 @@ TokenQueue_t calculator::toRPN(const char* expr,
       char quote = *expr;
 
       ++expr;
-      std::stringstream ss;
+      std::string str;
       while (*expr && *expr != quote && *expr != '\n') {
         if (*expr == '\\') {
           switch (expr[1]) {
           case 'n':
             expr+=2;
-            ss << '\n';
+            str.push_back('\n');
             break;
           case 't':
             expr+=2;
-            ss << '\t';
+            str.push_back('\t');
             break;
           default:
             if (strchr("\"'\n", expr[1])) ++expr;
-            ss << *expr;
+            str.push_back(*expr);
             ++expr;
           }
         } else {
-          ss << *expr;
-          ++expr;
+          // Copy the whole run of plain characters at once:
+          const char* start = expr;
+          while (*expr && *expr != quote && *expr != '\n' && *expr != '\\') {
+            ++expr;
+          }
+          str.append(start, expr);
         }
       }
 
       if (*expr != quote) {
         std::string squote = (quote == '"' ? "\"": "'");
-        rpnBuilder::cleanRPN(&data.rpn);
-        throw syntax_error("Expected quote (" + squote +
-                           ") at end of string declaration: " + squote + ss.str() + ".");
+        error->set(calcError_t::SYNTAX_ERROR, "Expected quote (",
+                   squote + ") at end of string declaration: " + squote + str,
+                   ".");
+        return abort_rpn(&data);
       }
       ++expr;
-      data.handle_token(new Token<std::string>(ss.str(), STR));
+      data.handle_token(new Token<std::string>(str, STR));
     } else {
       // Otherwise, the variable is an operator or paranthesis.
       switch (*expr) {
@@ -361,7 +1043,7 @@ TokenQueue_t calculator::toRPN(const char* expr,
         // If it is a function call:
         if (data.lastTokenWasOp == false) {
           // This counts as a bracket and as an operator:
-          data.handle_op("()");
+          if (!data.try_handle_op("()", error)) return abort_rpn(&data);
           // Add it as a bracket to the op stack:
         }
         data.open_bracket("(");
@@ -370,14 +1052,14 @@ TokenQueue_t calculator::toRPN(const char* expr,
       case '[':
         if (data.lastTokenWasOp == false) {
           // If it is an operator:
-          data.handle_op("[]");
+          if (!data.try_handle_op("[]", error)) return abort_rpn(&data);
         } else {
           // If it is the list constructor:
           // Add the list constructor to the rpn:
           data.handle_token(new CppFunction(&TokenList::default_constructor, "list"));
 
           // We make the program see it as a normal function call:
-          data.handle_op("()");
+          if (!data.try_handle_op("()", error)) return abort_rpn(&data);
         }
         // Add it as a bracket to the op stack:
         data.open_bracket("[");
@@ -388,20 +1070,20 @@ TokenQueue_t calculator::toRPN(const char* expr,
         data.handle_token(new CppFunction(&TokenMap::default_constructor, "map"));
 
         // We make the program see it as a normal function call:
-        data.handle_op("()");
+        if (!data.try_handle_op("()", error)) return abort_rpn(&data);
         data.open_bracket("{");
         ++expr;
         break;
       case ')':
-        data.close_bracket("(");
+        if (!data.try_close_bracket("(", error)) return abort_rpn(&data);
         ++expr;
         break;
       case ']':
-        data.close_bracket("[");
+        if (!data.try_close_bracket("[", error)) return abort_rpn(&data);
         ++expr;
         break;
       case '}':
-        data.close_bracket("{");
+        if (!data.try_close_bracket("{", error)) return abort_rpn(&data);
         ++expr;
         break;
       default:
@@ -409,73 +1091,221 @@ TokenQueue_t calculator::toRPN(const char* expr,
           // Then the token is an operator
 
           const char* start = expr;
-          std::stringstream ss;
-          ss << *expr;
           ++expr;
-          while (*expr && ispunct(*expr) && !strchr("+-'\"()[]{}_", *expr)) {
-            ss << *expr;
-            ++expr;
-          }
-          std::string op = ss.str();
-
-          // Check if the word parser applies:
-          rWordParser_t* parser = config.parserMap.find(op);
+          while (rpnBuilder::charClass(*expr) & CC_OPCHAR) ++expr;
 
           // Evaluate the meaning of this operator in the following order:
           // 1. Is there a word parser for it?
           // 2. Is it a valid operator?
           // 3. Is there a character parser for its first character?
+          // 4. Is there a word parser or operator matching its longest prefix?
+          const lexicon_t::entry_t* entry = lex.find(start, expr);
+          rWordParser_t* parser = 0;
+
+          if (!entry || (!entry->parser && !entry->is_op)) {
+            if ((parser = lex.char_parser(*start))) {
+              expr = start+1;
+              entry = 0;
+            } else if ((entry = lex.longest_match(start, expr, &expr)) == 0) {
+              error->set(calcError_t::SYNTAX_ERROR, "Invalid operator: ",
+                         std::string(start, expr));
+              return abort_rpn(&data);
+            }
+          }
+
+          if (entry && entry->parser) parser = entry->parser;
+
           if (parser) {
             // Parse reserved operators:
             try {
               parser(expr, &expr, &data);
             } catch (...) {
-              rpnBuilder::cleanRPN(&data.rpn);
-              throw;
+              error->set_exception(std::current_exception());
+              return abort_rpn(&data);
             }
-          } else if (data.opp.exists(op)) {
-            data.handle_op(op);
-          } else if ((parser=config.parserMap.find(op[0]))) {
-            expr = start+1;
-            try {
-              parser(expr, &expr, &data);
-            } catch (...) {
-              rpnBuilder::cleanRPN(&data.rpn);
-              throw;
-            }
-          } else {
-            rpnBuilder::cleanRPN(&data.rpn);
-            throw syntax_error("Invalid operator: " + op);
+          } else if (!data.try_handle_op(entry, error)) {
+            return abort_rpn(&data);
           }
         }
       }
     }
     // Ignore spaces but stop on delimiter if not inside brackets.
-    while (*expr && isspace(*expr)
-           && (data.bracketLevel || !strchr(delim, *expr))) ++expr;
+    if (data.bracketLevel) {
+      expr = rpnBuilder::skipSpaces(expr, no_delims);
+    } else {
+      expr = rpnBuilder::skipSpaces(expr, delims);
+    }
   }
 
   // Check for syntax errors (excess of operators i.e. 10 + + -1):
   if (data.lastTokenWasUnary) {
-    rpnBuilder::cleanRPN(&data.rpn);
-    throw syntax_error("Expected operand after unary operator `" + data.opStack.top() + "`");
+    error->set(calcError_t::SYNTAX_ERROR,
+               "Expected operand after unary operator `", data.opStack.top(), "`");
+    return abort_rpn(&data);
   }
 
-  std::string cur_op;
   while (!data.opStack.empty()) {
-    cur_op = normalize_op(data.opStack.top());
-    data.rpn.push(new Token<std::string>(cur_op, OP));
-    data.opStack.pop();
+    data.pop_op();
   }
 
   // In case one of the custom parsers left an empty expression:
   if (data.rpn.size() == 0) data.rpn.push(new TokenNone());
   if (rest) *rest = expr;
-  return data.rpn;
+}
+
+/* * * * * Compiled expressions cache * * * * */
+
+namespace {
+
+// A compiled expression, shared by the cache and its users
+// so it is only released when no one is evaluating it:
+struct cachedRPN_t {
+  TokenQueue_t rpn;
+  explicit cachedRPN_t(const TokenQueue_t& rpn) : rpn(rpn) {}
+  ~cachedRPN_t() { rpnBuilder::cleanRPN(&rpn); }
+};
+
+typedef std::shared_ptr<const cachedRPN_t> cachedProgram_t;
+
+class rpnCache_t {
+  typedef std::pair<const Config_t*, std::string> key_t;
+
+  struct key_hash {
+    size_t operator()(const key_t& key) const {
+      return std::hash<std::string>()(key.second) ^
+             (std::hash<const void*>()(key.first) << 1);
+    }
+  };
+
+  struct entry_t {
+    key_t key;
+    cachedProgram_t program;
+    // Versions of the config when it was compiled:
+    uint64_t parser_version;
+    uint64_t opp_version;
+  };
+
+  // The most recently used entries are kept at the front:
+  typedef std::list<entry_t> lru_t;
+  lru_t lru;
+  std::unordered_map<key_t, lru_t::iterator, key_hash> index;
+
+  calculator::cacheStats_t stats;
+  mutable std::mutex mutex;
+
+ private:
+  void evict_to(size_t size) {
+    while (lru.size() > size) {
+      index.erase(lru.back().key);
+      lru.pop_back();
+      ++stats.evictions;
+    }
+  }
+
+ public:
+  explicit rpnCache_t(size_t capacity) { stats.capacity = capacity; }
+
+  cachedProgram_t get(const char* expr, const Config_t& config) {
+    key_t key(&config, expr);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = index.find(key);
+      if (it != index.end()) {
+        entry_t& entry = *it->second;
+        if (entry.parser_version == config.parserMap.version() &&
+            entry.opp_version == config.opPrecedence.version()) {
+          lru.splice(lru.begin(), lru, it->second);
+          ++stats.hits;
+          return entry.program;
+        }
+
+        // The config has changed since it was compiled:
+        lru.erase(it->second);
+        index.erase(it);
+      }
+      ++stats.misses;
+    }
+
+    // Variables are compiled against an empty scope, so they are
+    // all resolved at evaluation time and the program can be reused
+    // with any scope:
+    uint64_t parser_version = config.parserMap.version();
+    uint64_t opp_version = config.opPrecedence.version();
+    cachedProgram_t program = std::make_shared<const cachedRPN_t>(
+        calculator::toRPN(expr, TokenMap(0), 0, 0, config));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stats.capacity == 0) return program;
+
+    auto it = index.find(key);
+    if (it != index.end()) {
+      // Another thread compiled it first:
+      lru.erase(it->second);
+      index.erase(it);
+    }
+
+    lru.push_front(entry_t{key, program, parser_version, opp_version});
+    index[key] = lru.begin();
+    evict_to(stats.capacity);
+
+    return program;
+  }
+
+  calculator::cacheStats_t get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    calculator::cacheStats_t result = stats;
+    result.size = lru.size();
+    return result;
+  }
+
+  void set_capacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.capacity = capacity;
+    evict_to(capacity);
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    index.clear();
+    lru.clear();
+    size_t capacity = stats.capacity;
+    stats = calculator::cacheStats_t();
+    stats.capacity = capacity;
+  }
+};
+
+rpnCache_t& rpn_cache() {
+  static rpnCache_t cache(256);
+  return cache;
+}
+
+}  // namespace
+
+calculator::cacheStats_t calculator::cache_stats() {
+  return rpn_cache().get_stats();
+}
+
+void calculator::set_cache_capacity(size_t capacity) {
+  rpn_cache().set_capacity(capacity);
+}
+
+void calculator::clear_cache() {
+  rpn_cache().clear();
 }
 
 packToken calculator::calculate(const char* expr, TokenMap vars,
                                 const char* delim, const char** rest) {
+  // When a delimiter is used the expression might
+  // end before the end of the text, so don't cache it:
+  if (delim == 0) {
+    cachedProgram_t program = rpn_cache().get(expr, Default());
+    if (rest) *rest = expr + strlen(expr);
+
+    TokenBase* ret = calculator::calculate(program->rpn, vars);
+    return packToken(resolve_reference(ret));
+  }
+
   // Convert to RPN with Dijkstra's Shunting-yard algorithm.
   RAII_TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest);
 
@@ -484,6 +1314,25 @@ packToken calculator::calculate(const char* expr, TokenMap vars,
   return packToken(resolve_reference(ret));
 }
 
+namespace {
+
+// Variable names compiled by toRPN() are interned:
+const packToken* find_var(const TokenMap& scope, const TokenBase* var) {
+  const Token<std::string>* name = static_cast<const Token<std::string>*>(var);
+  return name->atom ? scope.find(name->atom) : scope.find(name->value());
+}
+
+// Build the key of a reference to a variable:
+packToken var_key(const TokenBase* var) {
+  // Share the name's string, interned or not:
+  Token<std::string>* key =
+      new Token<std::string>(*static_cast<const Token<std::string>*>(var));
+  key->type = STR;
+  return packToken(key);
+}
+
+}  // namespace
+
 void cleanStack(std::stack<TokenBase*> st) {
   while (st.size() > 0) {
     delete resolve_reference(st.top());
@@ -493,24 +1342,54 @@ void cleanStack(std::stack<TokenBase*> st) {
 
 TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
                                  const Config_t& config) {
-  evaluationData data(rpn, scope, config.opMap);
+  calcError_t error;
+  TokenBase* result = calculate(rpn, scope, config, &error);
+  if (error) error.raise();
+  return result;
+}
+
+TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
+                                 const Config_t& config, calcError_t* error,
+                                 const TokenMap* bound) {
+  // Iterate over the queue's container instead of copying it:
+  struct items_t : TokenQueue_t {
+    static const container_type& of(const TokenQueue_t& queue) {
+      return queue.*&items_t::c;
+    }
+  };
+  const TokenQueue_t::container_type& items = items_t::of(rpn);
+  return calculate(items.begin(), items.end(), scope, config, error, bound);
+}
+
+template <typename It>
+TokenBase* calculator::calculate(It first, It last, TokenMap scope,
+                                 const Config_t& config, calcError_t* error,
+                                 const TokenMap* bound) {
+  evaluationData data(scope, config.opMap);
 
   // Evaluate the expression in RPN form.
   std::stack<TokenBase*> evaluation;
-  while (!data.rpn.empty()) {
-    TokenBase* base = data.rpn.front()->clone();
-    data.rpn.pop();
+  for (; first != last; ++first) {
+    if (const char* limit = evalBudget_t::step()) {
+      cleanStack(evaluation);
+      error->set(calcError_t::BUDGET_EXCEEDED,
+                 "Evaluation exceeded its ", limit, " budget.");
+      return 0;
+    }
+
+    TokenBase* base = (*first)->clone();
 
     // Operator:
     if (base->type == OP) {
-      data.op = static_cast<Token<std::string>*>(base)->val;
+      data.op = static_cast<Token<std::string>*>(base)->value();
       delete base;
 
       /* * * * * Resolve operands Values and References: * * * * */
 
       if (evaluation.size() < 2) {
         cleanStack(evaluation);
-        throw std::domain_error("Invalid equation.");
+        error->set(calcError_t::DOMAIN_ERROR, "Invalid equation.");
+        return 0;
       }
       TokenBase* r_token = evaluation.top(); evaluation.pop();
       TokenBase* l_token = evaluation.top(); evaluation.pop();
@@ -519,8 +1398,7 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
         data.right.reset(static_cast<RefToken*>(r_token));
         r_token = data.right->resolve(&data.scope);
       } else if (r_token->type == VAR) {
-        packToken key = static_cast<Token<std::string>*>(r_token)->val;
-        data.right.reset(new RefToken(key));
+        data.right.reset(new RefToken(var_key(r_token)));
       } else {
         data.right.reset(new RefToken());
       }
@@ -529,8 +1407,7 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
         data.left.reset(static_cast<RefToken*>(l_token));
         l_token = data.left->resolve(&data.scope);
       } else if (l_token->type == VAR) {
-        packToken key = static_cast<Token<std::string>*>(l_token)->val;
-        data.left.reset(new RefToken(key));
+        data.left.reset(new RefToken(var_key(l_token)));
       } else {
         data.left.reset(new RefToken());
       }
@@ -560,10 +1437,17 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
         packToken ret;
         try {
           ret = Function::call(_this, l_func, &right, data.scope);
+        } catch (const budget_exceeded& e) {
+          cleanStack(evaluation);
+          delete l_func;
+          error->set_exception(std::current_exception(),
+                               calcError_t::BUDGET_EXCEEDED);
+          return 0;
         } catch (...) {
           cleanStack(evaluation);
           delete l_func;
-          throw;
+          error->set_exception(std::current_exception());
+          return 0;
         }
 
         delete l_func;
@@ -582,27 +1466,38 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
           if (!result) {
             result = exec_operation(l_pack, r_pack, &data, ANY_OP);
           }
+        } catch (const undefined_operation& e) {
+          // Custom operations may throw it for unsupported operands:
+          cleanStack(evaluation);
+          error->set_exception(std::current_exception(),
+                               calcError_t::UNDEFINED_OPERATION);
+          return 0;
+        } catch (const budget_exceeded& e) {
+          cleanStack(evaluation);
+          error->set_exception(std::current_exception(),
+                               calcError_t::BUDGET_EXCEEDED);
+          return 0;
         } catch (...) {
           cleanStack(evaluation);
-          throw;
+          error->set_exception(std::current_exception());
+          return 0;
         }
 
         if (result) {
           evaluation.push(result);
         } else {
           cleanStack(evaluation);
-          throw undefined_operation(data.op, l_pack, r_pack);
+          error->set_undefined_operation(data.op, l_pack, r_pack);
+          return 0;
         }
       }
     } else if (base->type == VAR) {  // Variable
-      packToken* value = NULL;
-      std::string key = static_cast<Token<std::string>*>(base)->val;
-
-      value = data.scope.find(key);
+      const packToken* value = find_var(data.scope, base);
+      if (!value && bound) value = find_var(*bound, base);
 
       if (value) {
         TokenBase* copy = (*value)->clone();
-        evaluation.push(new RefToken(key, copy));
+        evaluation.push(new RefToken(var_key(base), copy));
         delete base;
       } else {
         evaluation.push(base);
@@ -612,16 +1507,35 @@ TokenBase* calculator::calculate(const TokenQueue_t& rpn, TokenMap scope,
     }
   }
 
+  // The last step may have run past a limit too:
+  if (const char* limit = evalBudget_t::pending()) {
+    cleanStack(evaluation);
+    error->set(calcError_t::BUDGET_EXCEEDED,
+               "Evaluation exceeded its ", limit, " budget.");
+    return 0;
+  }
+
   return evaluation.top();
 }
 
+packToken calculator::eval(TokenBase* const* first, TokenBase* const* last,
+                           TokenMap vars, const Config_t& config,
+                           const TokenMap* bound) {
+  calcError_t error;
+  TokenBase* value = calculate(first, last, vars, config, &error, bound);
+  if (error) error.raise();
+  return packToken(resolve_reference(value));
+}
+
 /* * * * * Non Static Functions * * * * */
 
 calculator::~calculator() {
   rpnBuilder::cleanRPN(&this->RPN);
 }
 
-calculator::calculator(const calculator& calc) {
+calculator::calculator(const calculator& calc) : limits(calc.limits) {
+  if (calc.bound_vars) bound_vars.reset(new TokenMap(*calc.bound_vars));
+
   TokenQueue_t _rpn = calc.RPN;
 
   // Deep copy the token list, so everything can be
@@ -633,12 +1547,30 @@ calculator::calculator(const calculator& calc) {
   }
 }
 
+// The moved-from calculator is left as a default one,
+// i.e. it evaluates to None:
+calculator::calculator(calculator&& calc) noexcept
+                      : calculator() {
+  limits = calc.limits;
+  std::swap(this->RPN, calc.RPN);
+  std::swap(this->bound_vars, calc.bound_vars);
+}
+
 // Work as a sub-parser:
 // - Stops at delim or '\0'
 // - Returns the rest of the string as char* rest
 calculator::calculator(const char* expr, TokenMap vars, const char* delim,
                        const char** rest, const Config_t& config) {
   this->RPN = calculator::toRPN(expr, vars, delim, rest, config);
+  bind(vars, config);
+}
+
+void calculator::bind(TokenMap vars, const Config_t& config) {
+  if (config.bindMode == BIND_BY_REFERENCE) {
+    bound_vars.reset(new TokenMap(vars));
+  } else {
+    bound_vars.reset();
+  }
 }
 
 void calculator::compile(const char* expr, TokenMap vars, const char* delim,
@@ -647,10 +1579,52 @@ void calculator::compile(const char* expr, TokenMap vars, const char* delim,
   rpnBuilder::cleanRPN(&this->RPN);
 
   this->RPN = calculator::toRPN(expr, vars, delim, rest, Config());
+  bind(vars, Config());
+}
+
+calcError_t calculator::try_compile(const char* expr, TokenMap vars,
+                                    const char* delim, const char** rest) {
+  calcError_t error;
+  TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest, Config(), &error);
+  if (!error) {
+    rpnBuilder::cleanRPN(&this->RPN);
+    this->RPN = rpn;
+    bind(vars, Config());
+  }
+  return error;
+}
+
+void calculator::set_budget(const evalBudget_t& budget) {
+  limits = evalBudget_t();
+  limits.max_steps = budget.max_steps;
+  limits.max_tokens = budget.max_tokens;
+  limits.max_bytes = budget.max_bytes;
+}
+
+calcError_t calculator::try_eval(packToken* result, TokenMap vars,
+                                 bool keep_refs) const {
+  evalBudget_t usage = limits;
+  evalBudget_t::scope_t budget(limits.limited() ? &usage : 0);
+  calcError_t error;
+  TokenBase* value = calculate(this->RPN, vars, Config(), &error,
+                               bound_vars.get());
+  if (!error) {
+    if (keep_refs) {
+      *result = packToken(value);
+    } else {
+      *result = packToken(resolve_reference(value));
+    }
+  }
+  return error;
 }
 
 packToken calculator::eval(TokenMap vars, bool keep_refs) const {
-  TokenBase* value = calculate(this->RPN, vars, Config());
+  evalBudget_t usage = limits;
+  evalBudget_t::scope_t budget(limits.limited() ? &usage : 0);
+  calcError_t error;
+  TokenBase* value = calculate(this->RPN, vars, Config(), &error,
+                               bound_vars.get());
+  if (error) error.raise();
   packToken p = packToken(value->clone());
   if (keep_refs) {
     return packToken(value);
@@ -662,6 +1636,12 @@ packToken calculator::eval(TokenMap vars, bool keep_refs) const {
 calculator& calculator::operator=(const calculator& calc) {
   // Make sure the RPN is empty:
   rpnBuilder::cleanRPN(&this->RPN);
+  if (calc.bound_vars) {
+    bound_vars.reset(new TokenMap(*calc.bound_vars));
+  } else {
+    bound_vars.reset();
+  }
+  limits = calc.limits;
 
   // Deep copy the token list, so everything can be
   // safely deallocated:
@@ -674,6 +1654,15 @@ calculator& calculator::operator=(const calculator& calc) {
   return *this;
 }
 
+// The moved-from calculator will own the previous RPN
+// of the target, and will deallocate it when destroyed:
+calculator& calculator::operator=(calculator&& calc) noexcept {
+  std::swap(this->RPN, calc.RPN);
+  std::swap(this->bound_vars, calc.bound_vars);
+  limits = calc.limits;
+  return *this;
+}
+
 /* * * * * For Debug Only * * * * */
 
 std::string calculator::str() const {
@@ -11,7 +11,9 @@
 #include <set>
 #include <sstream>
 #include <memory>
+#include <atomic>
 #include <utility>
+#include <exception>
 
 /*
  * About tokType enum:
@@ -42,6 +44,7 @@ enum tokType {
   TUPLE = 0x42,   // == 0x40 + 0x02 => Tuples are iterators.
   STUPLE = 0x43,  // == 0x40 + 0x03 => ArgTuples are iterators.
   MAP = 0x44,     // == 0x40 + 0x04 => Maps are Iterators
+  NUM_ARRAY = 0x45,  // == 0x40 + 0x05 => Numeric arrays are iterators.
 
   // References are internal tokens used by the calculator:
   REF = 0x80,
@@ -52,12 +55,109 @@ enum tokType {
 
 #define ANY_OP ""
 
+// An interned identifier, e.g. a variable or an attribute name.
+//
+// Each distinct name is stored once for the whole program together with
+// its hash, so atoms are compared by pointer and TokenMap lookups by
+// atom don't need to hash or compare strings. Interned names are never
+// released, so only names found on the source code should be interned.
+class atom_t {
+  struct data_t {
+    size_t hash;
+    // Where the shape of the last map searched for
+    // this name keeps it, see TokenMap_t::shape_t:
+    mutable std::atomic<uint64_t> shape_cache;
+    explicit data_t(size_t hash) : hash(hash), shape_cache(0) {}
+  };
+
+  // The canonical name and its std::hash:
+  const std::pair<const std::string, data_t>* data;
+
+ public:
+  atom_t() : data(0) {}
+  explicit atom_t(const std::string& name);
+
+  const std::string& str() const { return data->first; }
+  size_t hash() const { return data->second.hash; }
+  std::atomic<uint64_t>& shape_cache() const { return data->second.shape_cache; }
+
+  // Unique for each name, e.g. to be used as a cache key:
+  const void* id() const { return data; }
+
+  explicit operator bool() const { return data != 0; }
+  bool operator==(const atom_t& other) const { return data == other.data; }
+  bool operator!=(const atom_t& other) const { return data != other.data; }
+};
+
+// Optional limits for evaluations, where 0 means unlimited:
+// - steps: RPN tokens evaluated.
+// - tokens: tokens allocated.
+// - bytes: string, list and array storage allocated by operations.
+//
+// A budget is enforced on the evaluations of a calculator with
+// calculator::set_budget(), or on every evaluation of a thread while
+// an evalBudget_t::scope_t lives. Nested evaluations, e.g. on function
+// calls, count against the budgets of the outer ones.
+//
+// Exceeding a limit throws a budget_exceeded, which try_eval()
+// reports as a BUDGET_EXCEEDED error.
+struct evalBudget_t {
+  uint64_t max_steps = 0;
+  uint64_t max_tokens = 0;
+  uint64_t max_bytes = 0;
+
+  // The usage so far:
+  uint64_t steps = 0;
+  uint64_t tokens = 0;
+  uint64_t bytes = 0;
+
+  bool limited() const { return max_steps || max_tokens || max_bytes; }
+  // The name of the first limit exceeded, or NULL:
+  const char* exceeded() const;
+
+  // Makes `budget` the current one of this thread while it lives:
+  struct scope_t {
+    evalBudget_t* budget;
+    explicit scope_t(evalBudget_t* budget);
+    ~scope_t();
+  };
+
+  // Counters updated by the evaluation and the allocators. Tokens
+  // are created where throwing is not expected, so the token limit is
+  // checked on each step, which returns the exceeded limit if any, and
+  // by count_bytes() and check(), which throw a budget_exceeded:
+  static const char* step() { return current ? current->add_step() : 0; }
+  static void count_token() { if (current) current->add_tokens(); }
+  static void count_bytes(size_t n) { if (current) current->add_bytes(n); }
+
+  // The name of a limit exceeded by the budgets of this thread, or NULL:
+  static const char* pending() { return current ? current->chain_exceeded() : 0; }
+  // Called by the loops that run within a single step, e.g. in the
+  // builtin functions, so one call can't run past the limits:
+  static void check() { if (current) current->throw_if_exceeded(); }
+
+ private:
+  evalBudget_t* parent = 0;
+  static thread_local evalBudget_t* current;
+
+  const char* chain_exceeded() const;
+  void throw_if_exceeded() const;
+  // Returns the name of a limit exceeded or NULL:
+  const char* add_step();
+  void add_tokens();
+  void add_bytes(size_t n);
+};
+
 struct TokenBase {
   tokType_t type;
 
   virtual ~TokenBase() {}
-  TokenBase() {}
-  TokenBase(tokType_t type) : type(type) {}
+  TokenBase() { evalBudget_t::count_token(); }
+  TokenBase(tokType_t type) : type(type) { evalBudget_t::count_token(); }
+  TokenBase(const TokenBase& other) : type(other.type) {
+    evalBudget_t::count_token();
+  }
+  TokenBase& operator=(const TokenBase&) = default;
 
   virtual TokenBase* clone() const = 0;
 };
@@ -71,6 +171,75 @@ template<class T> class Token : public TokenBase {
   }
 };
 
+// String tokens may also keep their value as an atom,
+// the lexer does it for variable and attribute names:
+template<> class Token<std::string> : public TokenBase {
+ public:
+  // The string is immutable and shared by every clone of the token, so
+  // cloning it is a pointer bump. Read it with value() and write it with
+  // mutable_value(), which copies it first if it is shared.
+  // While `builder` is set, it is only valid once `flattened` is:
+  mutable std::shared_ptr<std::string> payload;
+  atom_t atom;
+
+  // Long strings built by `+` share a buffer, and concatenating to the
+  // latest of them appends in place, so `s = s + x` in a loop is linear.
+  // The string is the first `size` characters of the buffer:
+  struct builder_t;
+  std::shared_ptr<builder_t> builder;
+  size_t size = 0;
+  // Readers on other threads may flatten the same token, so the
+  // string is copied out once, under the lock of the builder:
+  mutable std::atomic<bool> flattened{false};
+
+  Token(std::string t, tokType_t type)
+       : TokenBase(type), payload(std::make_shared<std::string>(std::move(t))) {}
+  Token(std::shared_ptr<std::string> payload, tokType_t type)
+       : TokenBase(type), payload(std::move(payload)) {}
+  // Points to the interned name instead of copying it. That payload has
+  // no owner, so mutable_value() never considers it unique:
+  Token(atom_t atom, tokType_t type)
+       : TokenBase(type),
+         payload(std::shared_ptr<std::string>(),
+                 const_cast<std::string*>(&atom.str())),
+         atom(atom) {}
+  Token(std::shared_ptr<builder_t> builder, size_t size)
+       : TokenBase(STR), builder(builder), size(size) {}
+  // Copies of a flattened string no longer need the buffer:
+  Token(const Token& other) : TokenBase(other), atom(other.atom), size(other.size) {
+    if (!other.builder || other.flattened.load(std::memory_order_acquire)) {
+      payload = other.payload;
+    } else {
+      builder = other.builder;
+    }
+  }
+  virtual TokenBase* clone() const {
+    return new Token(*this);
+  }
+
+  const std::string& value() const {
+    if (builder && !flattened.load(std::memory_order_acquire)) flatten();
+    return *payload;
+  }
+  std::string& mutable_value() {
+    if (builder) {
+      value();
+      builder.reset();
+    }
+    if (payload.use_count() != 1) {
+      payload = std::make_shared<std::string>(*payload);
+    }
+    // The string may no longer match the name:
+    atom = atom_t();
+    return *payload;
+  }
+
+  // Copy the string out of the shared buffer:
+  void flatten() const;
+
+  static Token* concat(const Token& left, const std::string& right);
+};
+
 struct TokenNone : public TokenBase {
   TokenNone() : TokenBase(NONE) {}
   virtual TokenBase* clone() const {
@@ -85,6 +254,12 @@ struct TokenUnary : public TokenBase {
   }
 };
 
+// Return a new unique stamp each time it is called.
+//
+// Configuration objects receive a new stamp on every change,
+// so data derived from them can detect when it is outdated.
+uint64_t new_version_stamp();
+
 class packToken;
 typedef std::queue<TokenBase*> TokenQueue_t;
 class OppMap_t {
@@ -92,6 +267,10 @@ class OppMap_t {
   std::set<std::string> RtoL;
   // Map of operators precedence:
   std::map<std::string, int> pr_map;
+  // Changes every time an operator is added:
+  uint64_t _version = new_version_stamp();
+
+  friend class lexicon_t;
 
  public:
   OppMap_t() {
@@ -109,6 +288,7 @@ class OppMap_t {
     }
 
     pr_map[op] = precedence;
+    _version = new_version_stamp();
   }
 
   void addUnary(const std::string& op, int precedence) {
@@ -143,22 +323,235 @@ class OppMap_t {
   int prec(const std::string& op) const { return pr_map.at(op); }
   bool assoc(const std::string& op) const { return RtoL.count(op); }
   bool exists(const std::string& op) const { return pr_map.count(op); }
+  uint64_t version() const { return _version; }
 };
 
 class TokenMap;
 class TokenList;
 class Tuple;
 class STuple;
+class NumArray;
 class Function;
 #include "./packToken.h"
 
-// Define the Tuple, TokenMap and TokenList classes:
+// Define the Tuple, TokenMap, TokenList and NumArray classes:
 #include "./containers.h"
 
 // Define the `Function` class
 // as well as some built-in functions:
 #include "./functions.h"
 
+// Character classes used by the parser, these are locale independent
+// and match the "C" locale versions of isspace(), isdigit(), etc:
+enum charClass {
+  CC_SPACE = 0x01,   // ' ', '\t', '\n', '\v', '\f' and '\r'
+  CC_DIGIT = 0x02,   // '0' to '9'
+  CC_ALPHA = 0x04,   // ASCII letters and '_', i.e. the start of a variable name
+  CC_PUNCT = 0x08,   // ASCII punctuation characters
+  CC_OPCHAR = 0x10,  // Punctuation that may be part of a multi-char operator
+  CC_UTF8 = 0x20     // Non-ASCII bytes, part of a multi-byte UTF8 character
+};
+
+// Bitmap with one bit per byte value, it is used to check
+// in constant time if a character is one of the delimiters.
+//
+// Like strchr() the '\0' character is always part of the set.
+struct charSet_t {
+  uint64_t bits[4];
+
+  // True if any whitespace character is part of the set:
+  bool spaces;
+
+  charSet_t(const char* chars = 0) : bits(), spaces(false) {
+    bits[0] = 1;
+    while (chars && *chars) {
+      unsigned char c = *chars++;
+      bits[c >> 6] |= uint64_t(1) << (c & 0x3F);
+      if (c == ' ' || (c >= '\t' && c <= '\r')) spaces = true;
+    }
+  }
+
+  bool has(const char c) const {
+    unsigned char uc = c;
+    return (bits[uc >> 6] >> (uc & 0x3F)) & 1;
+  }
+};
+
+// Error information reported by the non-throwing API,
+// i.e. calculator::try_compile() and calculator::try_eval().
+//
+// To keep failures cheap the error message is
+// only formatted when message() is called.
+struct calcError_t {
+  enum code_t {
+    OK = 0,
+    SYNTAX_ERROR,         // Thrown as a syntax_error
+    INVALID_ARGUMENT,     // Thrown as a std::invalid_argument
+    DOMAIN_ERROR,         // Thrown as a std::domain_error
+    UNDEFINED_OPERATION,  // Thrown as an undefined_operation
+    BUDGET_EXCEEDED,      // Thrown as a budget_exceeded
+    EXCEPTION             // Thrown by a function, operation or parser
+  };
+
+  code_t code = OK;
+
+  explicit operator bool() const { return code != OK; }
+
+  // The message will be `prefix + detail + suffix`:
+  void set(code_t code, const char* prefix,
+           std::string detail = "", const char* suffix = "");
+  void set_undefined_operation(const std::string& op,
+                               const packToken& left, const packToken& right);
+  // Keep an exception thrown by a function, operation or parser:
+  void set_exception(std::exception_ptr exception, code_t code = EXCEPTION);
+
+  std::string message() const;
+
+  // Throw the exception this error stands for:
+  void raise() const;
+
+ private:
+  const char* prefix = "";
+  const char* suffix = "";
+  std::string detail;
+  std::shared_ptr<const std::pair<packToken, packToken>> operands;
+  std::exception_ptr exception;
+};
+
+struct Config_t;
+struct rpnBuilder;
+// The reservedWordParser_t is the function type called when
+// a reserved word or character is found at parsing time.
+typedef void rWordParser_t(const char* expr, const char** rest,
+                           rpnBuilder* data);
+typedef std::map<std::string, rWordParser_t*> rWordMap_t;
+typedef std::map<char, rWordParser_t*> rCharMap_t;
+
+class parserMap_t {
+  rWordMap_t wmap;
+  rCharMap_t cmap;
+
+  // Changes every time a parser is added:
+  uint64_t _version = new_version_stamp();
+
+  friend class lexicon_t;
+
+ public:
+  // Add reserved word:
+  void add(const std::string& word, const rWordParser_t* parser) {
+    wmap[word] = parser;
+    _version = new_version_stamp();
+  }
+
+  // Add reserved character:
+  void add(char c, const rWordParser_t* parser) {
+    cmap[c] = parser;
+    _version = new_version_stamp();
+  }
+
+  rWordParser_t* find(const std::string text) const {
+    rWordMap_t::const_iterator w_it;
+
+    if ((w_it=wmap.find(text)) != wmap.end()) {
+      return w_it->second;
+    }
+
+    return 0;
+  }
+
+  rWordParser_t* find(char c) const {
+    rCharMap_t::const_iterator c_it;
+
+    if ((c_it=cmap.find(c)) != cmap.end()) {
+      return c_it->second;
+    }
+
+    return 0;
+  }
+
+  uint64_t version() const { return _version; }
+};
+
+// The lexicon_t is a compiled version of the reserved words
+// and operators of a configuration.
+//
+// All keys are kept on a trie, so that words and operators can be
+// looked up character by character without building temporary strings.
+// It is built on demand by Config_t::lexicon() and rebuilt whenever
+// the parserMap_t or OppMap_t it was built from is changed.
+class lexicon_t {
+ public:
+  struct entry_t {
+    // The key as it was added, e.g. "L-" for the unary minus:
+    std::string key;
+
+    // Parser for reserved words or 0:
+    rWordParser_t* parser = 0;
+
+    // Operator info, only valid if `is_op` is true:
+    bool is_op = false;
+    bool rtol = false;
+    int prec = 0;
+    // The operator name used on the RPN, e.g. "-" for "L-",
+    // its interned copy is shared by the OP tokens:
+    std::string name;
+    atom_t atom;
+
+    // The left and right unary versions of this operator or 0:
+    const entry_t* left = 0;
+    const entry_t* right = 0;
+  };
+
+ private:
+  struct node_t {
+    int32_t entry = -1;
+    std::vector<std::pair<char, uint32_t>> children;
+  };
+
+  std::vector<node_t> nodes;
+  std::vector<entry_t> entries;
+
+  // The root node and the reserved characters
+  // are indexed directly by the byte value:
+  uint32_t root[256];
+  rWordParser_t* char_parsers[256];
+
+  uint64_t parser_version;
+  uint64_t opp_version;
+
+ private:
+  uint32_t child(uint32_t node, char c) const;
+  entry_t* insert(const std::string& key);
+
+ public:
+  lexicon_t(const parserMap_t& parser, const OppMap_t& opp);
+  lexicon_t(const lexicon_t&) = delete;
+  lexicon_t& operator=(const lexicon_t&) = delete;
+
+  bool outdated(const parserMap_t& parser, const OppMap_t& opp) const {
+    return parser.version() != parser_version || opp.version() != opp_version;
+  }
+
+ public:
+  // Find an exact key, returns 0 if not found:
+  const entry_t* find(const char* begin, const char* end) const;
+  const entry_t* find(const std::string& key) const {
+    return find(key.data(), key.data() + key.size());
+  }
+
+  // Find the longest prefix of [begin, end) that is either an operator
+  // or a reserved word, returns 0 if there is none:
+  const entry_t* longest_match(const char* begin, const char* end,
+                               const char** match_end) const;
+
+  rWordParser_t* char_parser(char c) const {
+    return char_parsers[static_cast<unsigned char>(c)];
+  }
+
+  // Return the precedence of an operator on the op stack:
+  int prec(const std::string& key) const;
+};
+
 // This struct was created to expose internal toRPN() variables
 // to custom parsers, in special to the rWordParser_t functions.
 struct rpnBuilder {
@@ -169,31 +562,50 @@ struct rpnBuilder {
   TokenMap scope;
   const OppMap_t& opp;
 
+  // Compiled operators and reserved words:
+  std::shared_ptr<const lexicon_t> lex;
+
   // Used to make sure the expression won't
   // end inside a bracket evaluation just because
   // found a delimiter like '\n' or ')'
   uint32_t bracketLevel = 0;
 
-  rpnBuilder(TokenMap scope, const OppMap_t& opp) : scope(scope), opp(opp) {}
+  rpnBuilder(TokenMap scope, const OppMap_t& opp);
+  rpnBuilder(TokenMap scope, const Config_t& config);
 
  public:
   static void cleanRPN(TokenQueue_t* rpn);
 
  public:
   void handle_op(const std::string& op);
+  void handle_op(const lexicon_t::entry_t* op);
   void handle_token(TokenBase* token);
   void open_bracket(const std::string& bracket);
   void close_bracket(const std::string& bracket);
 
+  // Non-throwing versions of the functions above,
+  // on failure they return false and fill `error`:
+  bool try_handle_op(const std::string& op, calcError_t* error);
+  bool try_handle_op(const lexicon_t::entry_t* op, calcError_t* error);
+  bool try_close_bracket(const std::string& bracket, calcError_t* error);
+  // Move the operator on top of the op stack into the rpn:
+  void pop_op();
+
   // * * * * * Static parsing helpers: * * * * * //
 
+  // Lookup table with the charClass bits of each byte value:
+  static const uint8_t charClasses[256];
+
+  static inline uint8_t charClass(const char c) {
+    return charClasses[static_cast<unsigned char>(c)];
+  }
+
   // Check if a character is the first character of a variable:
   // Returns the byte-length of the character
   // (rest is needed for UTF8 characters)
   static inline unsigned char isvarchar(const char c, const char** rest) {
-    unsigned char utf8charsize = isUTF8char(c, rest);
-    if(utf8charsize == 0) return isalpha(c) || c == '_' ? true : false;
-    return utf8charsize;
+    if (charClass(c) & CC_ALPHA) return true;
+    return isUTF8char(c, rest);
   }
 
   // Checks if this is the start of a multi-character unicode character
@@ -201,45 +613,42 @@ struct rpnBuilder {
   // returns zero if it is not a multi-character unicode character
   // throws a domain_error exception if the character is malformed
   static inline unsigned char isUTF8char(const char c, const char** rest) {
-    unsigned char counter = 0;
-    if(c & 0x80) { // This is the start of a multi-char unicode character
-      counter++;
-      if(c & 0x40) counter++;
-      if(c & 0x20) counter++;
-      if(c & 0x10) counter++;
-      for(int i = 0; i < counter; i++) {
-        if(!((*rest)[i] & 0x80))
-          throw std::domain_error("Subsequent bytes of unicode character have to be of the form \\b10xxxxxx");
-      }
-    }
-    return counter;
+    if (!(c & 0x80)) return 0;
+    return UTF8charSize(*rest);
   }
 
+  // Validate the UTF8 character starting at `str` and return its byte-size.
+  // Throws a domain_error exception if it is malformed.
+  static unsigned char UTF8charSize(const char* str);
+
+  // Skip the characters of a variable name, i.e. ASCII letters,
+  // digits, '_' and valid multi-byte UTF8 characters:
+  static const char* skipVar(const char* expr);
+
+  // Parse a numeric literal, e.g. `10`, `1.5e3`, `0xFF`, `0b101` or `1_000`,
+  // and return it as an INT or REAL token. Integer literals too big
+  // for an int64_t are returned as REAL numbers.
+  static TokenBase* parseNumber(const char* expr, const char** rest);
+
+  // Skip whitespace stopping on the first delimiter found:
+  static const char* skipSpaces(const char* expr, const charSet_t& delim);
+
   static inline std::string parseVar(const char* expr, const char** rest = 0) {
-    std::stringstream ss;
-    unsigned char charsize;
-    do {
-        charsize = isvarchar(*expr, rest) + isdigit(*expr);
-        for (int i = 0; i < charsize; i++) {
-            ss << *expr++;
-            *rest = expr;
-        }
-    } while(charsize);
-    if (rest) *rest = expr;
-    return ss.str();
+    const char* end = skipVar(expr);
+    if (rest) *rest = end;
+    return std::string(expr, end);
   }
 
  private:
-  void handle_opStack(const std::string& op);
-  void handle_binary(const std::string& op);
-  void handle_left_unary(const std::string& op);
-  void handle_right_unary(const std::string& op);
+  void handle_opStack(const lexicon_t::entry_t* op);
+  void handle_binary(const lexicon_t::entry_t* op);
+  void handle_left_unary(const lexicon_t::entry_t* op);
+  void handle_right_unary(const lexicon_t::entry_t* op);
 };
 
 class RefToken;
 class opMap_t;
 struct evaluationData {
-  TokenQueue_t rpn;
   TokenMap scope;
   const opMap_t& opMap;
 
@@ -249,50 +658,11 @@ struct evaluationData {
   std::string op;
   opID_t opID;
 
-  evaluationData(TokenQueue_t rpn, TokenMap scope, const opMap_t& opMap)
-                : rpn(rpn), scope(scope), opMap(opMap) {}
-};
-
-// The reservedWordParser_t is the function type called when
-// a reserved word or character is found at parsing time.
-typedef void rWordParser_t(const char* expr, const char** rest,
-                           rpnBuilder* data);
-typedef std::map<std::string, rWordParser_t*> rWordMap_t;
-typedef std::map<char, rWordParser_t*> rCharMap_t;
-
-struct parserMap_t {
-  rWordMap_t wmap;
-  rCharMap_t cmap;
-
-  // Add reserved word:
-  void add(const std::string& word, const rWordParser_t* parser) {
-    wmap[word] = parser;
-  }
-
-  // Add reserved character:
-  void add(char c, const rWordParser_t* parser) {
-    cmap[c] = parser;
-  }
-
-  rWordParser_t* find(const std::string text) {
-    rWordMap_t::iterator w_it;
-
-    if ((w_it=wmap.find(text)) != wmap.end()) {
-      return w_it->second;
-    }
-
-    return 0;
-  }
-
-  rWordParser_t* find(char c) {
-    rCharMap_t::iterator c_it;
-
-    if ((c_it=cmap.find(c)) != cmap.end()) {
-      return c_it->second;
-    }
+  // Set by Operation::reject():
+  bool rejected = false;
 
-    return 0;
-  }
+  evaluationData(TokenMap scope, const opMap_t& opMap)
+                : scope(scope), opMap(opMap) {}
 };
 
 // The RefToken keeps information about the context
@@ -317,7 +687,11 @@ class RefToken : public TokenBase {
     // thus, require a localScope to be resolved:
     if (origin->type == NONE && localScope) {
       // Get the most recent value from the local scope:
-      packToken* r_value = localScope->find(key.asString());
+      const Token<std::string>* name =
+          static_cast<const Token<std::string>*>(key.token());
+      packToken* r_value = (key->type == STR && name->atom) ?
+                           localScope->find(name->atom) :
+                           localScope->find(key.asConstString());
       if (r_value) {
         result = (*r_value)->clone();
       }
@@ -348,6 +722,14 @@ class Operation {
   // Without stoping the operation matching process.
   struct Reject : public std::exception {};
 
+  // Same as throwing Reject but without the cost of an exception, usage:
+  //
+  //   return Operation::reject(data);
+  static packToken reject(evaluationData* data) {
+    data->rejected = true;
+    return packToken::None();
+  }
+
  public:
   static inline uint32_t mask(tokType_t type);
   static opID_t build_mask(tokType_t left, tokType_t right);
@@ -388,14 +770,37 @@ struct opMap_t : public std::map<std::string, opList_t> {
   }
 };
 
+// How the variables found on the `vars` scope are compiled:
+enum bindMode_t {
+  // Copy their values into the RPN, so later
+  // changes to the `vars` scope are not seen:
+  BIND_BY_VALUE,
+
+  // Only save their names and keep a reference to the `vars` scope.
+  // When evaluated they are looked up on the evaluation scope first
+  // and then on the `vars` scope, so the latest value is used.
+  BIND_BY_REFERENCE
+};
+
 struct Config_t {
   parserMap_t parserMap;
   OppMap_t opPrecedence;
   opMap_t opMap;
+  bindMode_t bindMode = BIND_BY_VALUE;
 
   Config_t() {}
   Config_t(parserMap_t p, OppMap_t opp, opMap_t opMap)
           : parserMap(p), opPrecedence(opp), opMap(opMap) {}
+
+  // Return the compiled reserved words and operators,
+  // rebuilding them if the configuration has changed:
+  std::shared_ptr<const lexicon_t> lexicon() const;
+
+ private:
+  // Copies of a Config_t share the same compiled lexicon
+  // until one of them is changed:
+  typedef std::shared_ptr<const lexicon_t> lexiconSlot_t;
+  mutable std::shared_ptr<lexiconSlot_t> _lexicon = std::make_shared<lexiconSlot_t>();
 };
 
 class calculator {
@@ -414,22 +819,73 @@ class calculator {
                               const Config_t& config = Default());
   static TokenQueue_t toRPN(const char* expr, TokenMap vars,
                             const char* delim = 0, const char** rest = 0,
-                            Config_t config = Default());
+                            const Config_t& config = Default());
+
+ private:
+  // Non-throwing versions of toRPN() and calculate(), on failure
+  // they fill `error` and return an empty RPN or NULL respectively:
+  static TokenQueue_t toRPN(const char* expr, TokenMap vars,
+                            const char* delim, const char** rest,
+                            const Config_t& config, calcError_t* error);
+  static TokenBase* calculate(const TokenQueue_t& RPN, TokenMap scope,
+                              const Config_t& config, calcError_t* error,
+                              const TokenMap* bound = 0);
+
+  // Used by script, which keeps the RPN of all its statements on one
+  // vector. This toRPN() leaves the RPN on `data`, or nothing on errors,
+  // and the same `data` parses the next statement once it is taken:
+  static void toRPN(rpnBuilder* data, const char* expr, const charSet_t& delims,
+                    const char** rest, const Config_t& config, calcError_t* error);
+  // Evaluate the tokens in [first, last):
+  template <typename It>
+  static TokenBase* calculate(It first, It last, TokenMap scope,
+                              const Config_t& config, calcError_t* error,
+                              const TokenMap* bound);
+  static packToken eval(TokenBase* const* first, TokenBase* const* last,
+                        TokenMap vars, const Config_t& config,
+                        const TokenMap* bound);
+  friend class script;
+
+ public:
+  // The static calculate() keeps an LRU cache of compiled expressions
+  // keyed by the expression text and by the config used to compile it:
+  struct cacheStats_t {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+  };
+
+  static cacheStats_t cache_stats();
+  // Set the max number of cached expressions, 0 disables the cache:
+  static void set_cache_capacity(size_t capacity);
+  static void clear_cache();
 
  public:
   // Used to dealloc a TokenQueue_t safely.
   struct RAII_TokenQueue_t;
 
  protected:
-  virtual const Config_t Config() const { return Default(); }
+  // Subclasses may override it to use a custom configuration.
+  // It is called on every compile() and eval(), so it should
+  // return a reference to a long lived Config_t instead of a copy:
+  virtual const Config_t& Config() const { return Default(); }
 
  private:
   TokenQueue_t RPN;
+  // The `vars` scope used with BIND_BY_REFERENCE:
+  std::unique_ptr<TokenMap> bound_vars;
+  // The limits of each eval(), its usage is not kept:
+  evalBudget_t limits;
+
+  void bind(TokenMap vars, const Config_t& config);
 
  public:
   virtual ~calculator();
   calculator() { this->RPN.push(new TokenNone()); }
   calculator(const calculator& calc);
+  calculator(calculator&& calc) noexcept;
   calculator(const char* expr, TokenMap vars = &TokenMap::empty,
              const char* delim = 0, const char** rest = 0,
              const Config_t& config = Default());
@@ -437,12 +893,39 @@ class calculator {
                const char* delim = 0, const char** rest = 0);
   packToken eval(TokenMap vars = &TokenMap::empty, bool keep_refs = false) const;
 
+  // Non-throwing versions of compile() and eval(), e.g.:
+  //
+  //   if (calcError_t error = c.try_compile("1 + ")) {
+  //     std::cout << error.message() << std::endl;
+  //   }
+  //
+  // If compilation fails the calculator is left unchanged.
+  calcError_t try_compile(const char* expr, TokenMap vars = &TokenMap::empty,
+                          const char* delim = 0, const char** rest = 0);
+  calcError_t try_eval(packToken* result, TokenMap vars = &TokenMap::empty,
+                       bool keep_refs = false) const;
+
+  // Limit each evaluation of this calculator, see evalBudget_t:
+  void set_budget(const evalBudget_t& budget);
+  const evalBudget_t& budget() const { return limits; }
+
   // Serialization:
   std::string str() const;
   static std::string str(TokenQueue_t rpn);
 
+  // Save the compiled RPN in a versioned binary format, so it can be
+  // loaded back without parsing the expression again.
+  //
+  // Functions are saved by name and are resolved when loading
+  // from the `builtins` scope. load() returns the number of bytes read.
+  // Variables bound with BIND_BY_REFERENCE are saved by name only.
+  std::string dump() const;
+  size_t load(const char* data, size_t size,
+              TokenMap builtins = &TokenMap::default_global());
+
   // Operators:
   calculator& operator=(const calculator& calc);
+  calculator& operator=(calculator&& calc) noexcept;
 };
 
 #endif  // SHUNTING_YARD_H_
@@ -1,9 +1,17 @@
+#include <cmath>
+#include <clocale>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <string>
+#include <thread>
 #include "catch.hpp"
 
 #include "./shunting-yard.h"
+#include "./shunting-yard-exceptions.h"
+#include "./script.h"
 
 TokenMap vars, emap, tmap, key3;
 
@@ -40,6 +48,52 @@ TEST_CASE("Static calculate::calculate()", "[calculate]") {
   REQUIRE(calculator::calculate("4 * -3", vars).asInt() == -12);
 }
 
+TEST_CASE("Compiled expressions cache", "[calculate][cache]") {
+  calculator::clear_cache();
+  TokenMap scope;
+
+  // Variables must be resolved on each evaluation:
+  scope["a"] = 1;
+  REQUIRE(calculator::calculate("a + 1", scope) == 2);
+  scope["a"] = 10;
+  REQUIRE(calculator::calculate("a + 1", scope) == 11);
+  REQUIRE_THROWS(calculator::calculate("a + 1"));
+
+  calculator::cacheStats_t stats = calculator::cache_stats();
+  REQUIRE(stats.hits == 2);
+  REQUIRE(stats.misses == 1);
+  REQUIRE(stats.size == 1);
+
+  const char* expr = "a * 2";
+  const char* rest = 0;
+  REQUIRE(calculator::calculate(expr, scope, 0, &rest) == 20);
+  REQUIRE(calculator::calculate(expr, scope, 0, &rest) == 20);
+  REQUIRE(rest == expr + 5);
+
+  // Changing the config should invalidate the entries:
+  rWordParser_t* parser = calculator::Default().parserMap.find("True");
+  calculator::Default().parserMap.add("True", parser);
+  REQUIRE(calculator::calculate("a + 1", scope) == 11);
+  REQUIRE(calculator::cache_stats().misses == 3);
+
+  // Expressions with a delimiter are not cached:
+  REQUIRE(calculator::calculate("a + 2; a", scope, ";") == 12);
+  REQUIRE(calculator::cache_stats().size == 2);
+
+  calculator::set_cache_capacity(2);
+  REQUIRE(calculator::calculate("1 + 1") == 2);
+  stats = calculator::cache_stats();
+  REQUIRE(stats.size == 2);
+  REQUIRE(stats.evictions == 1);
+
+  calculator::set_cache_capacity(0);
+  REQUIRE(calculator::cache_stats().size == 0);
+  REQUIRE(calculator::calculate("1 + 1") == 2);
+  REQUIRE(calculator::cache_stats().size == 0);
+
+  calculator::set_cache_capacity(256);
+}
+
 TEST_CASE("calculate::compile() and calculate::eval()", "[compile]") {
   calculator c1;
   c1.compile("-pi+1", vars);
@@ -53,6 +107,47 @@ TEST_CASE("calculate::compile() and calculate::eval()", "[compile]") {
   REQUIRE(c3.eval(vars).asDouble() == Approx(4.0));
 }
 
+TEST_CASE("Numeric literals", "[number]") {
+  REQUIRE(calculator::calculate("10")->type == INT);
+  REQUIRE(calculator::calculate("10.0")->type == REAL);
+  REQUIRE(calculator::calculate("1e3")->type == REAL);
+  REQUIRE(calculator::calculate("1e3").asDouble() == 1000);
+  REQUIRE(calculator::calculate("2.5E-3").asDouble() == 0.0025);
+  REQUIRE(calculator::calculate("0.1").asDouble() == 0.1);
+  REQUIRE(calculator::calculate("123456.789e-2").asDouble() == 1234.56789);
+  REQUIRE(calculator::calculate("3.14159265358979323846264338").asDouble() == 3.141592653589793);
+  REQUIRE(calculator::calculate("1e400").asDouble() == HUGE_VAL);
+
+  // Hexadecimal, binary and underscore separated literals:
+  REQUIRE(calculator::calculate("0x1F").asInt() == 31);
+  REQUIRE(calculator::calculate("0Xff + 1").asInt() == 256);
+  REQUIRE(calculator::calculate("0b1010").asInt() == 10);
+  REQUIRE(calculator::calculate("1_000_000").asInt() == 1000000);
+  REQUIRE(calculator::calculate("0xFFFF_FFFF").asInt() == 0xFFFFFFFFll);
+  REQUIRE(calculator::calculate("1_000.000_5").asDouble() == 1000.0005);
+  REQUIRE(calculator::calculate("0xFFFFFFFFFFFFFFFF").asInt() == -1);
+  REQUIRE_THROWS(calculator::calculate("0x1_0000_0000_0000_0000"));
+
+  // Integers too big for an int64_t become real numbers:
+  REQUIRE(calculator::calculate("9223372036854775807")->type == INT);
+  REQUIRE(calculator::calculate("9223372036854775808")->type == REAL);
+  REQUIRE(calculator::calculate("9223372036854775808").asDouble() == 9223372036854775808.0);
+
+  // An exponent without digits is not part of the number:
+  TokenMap v1;
+  v1["e"] = 5;
+  REQUIRE(calculator::calculate("1 *e", v1).asInt() == 5);
+
+  // The host locale doesn't change the decimal point, e.g. on the
+  // strtod() path of the literals with too many digits:
+  std::string previous = setlocale(LC_NUMERIC, 0);
+  if (setlocale(LC_NUMERIC, "de_DE.UTF-8") || setlocale(LC_NUMERIC, "fr_FR.UTF-8")) {
+    REQUIRE(calculator::calculate("1.5").asDouble() == 1.5);
+    REQUIRE(calculator::calculate("3.14159265358979323846264338").asDouble() == 3.141592653589793);
+  }
+  setlocale(LC_NUMERIC, previous.c_str());
+}
+
 TEST_CASE("Boolean expressions") {
   REQUIRE_FALSE(calculator::calculate("3 < 3").asBool());
   REQUIRE(calculator::calculate("3 <= 3").asBool());
@@ -218,6 +313,74 @@ TEST_CASE("String operations") {
   REQUIRE(calculator::calculate("'foobar'[-3]").asString() == "b");
 }
 
+TEST_CASE("String concatenation", "[string]") {
+  TokenMap vars;
+  vars["s"] = "";
+  calculator append("s = s + 'abcd' + i");
+  for (int i = 0; i < 1000; ++i) {
+    vars["i"] = i;
+    append.eval(vars);
+  }
+
+  // Long results share a buffer until read:
+  const TokenBase* s = vars["s"].token();
+  REQUIRE(static_cast<const Token<std::string>*>(s)->builder);
+  REQUIRE(vars["s"].asString().substr(0, 15) == "abcd0abcd1abcd2");
+  REQUIRE(vars["s"].asString().size() == 4 * 1000 + 10 + 90 * 2 + 900 * 3);
+  REQUIRE(!static_cast<const Token<std::string>*>(s)->builder);
+
+  // Two strings built from the same one:
+  vars["t"] = std::string(100, 'x');
+  REQUIRE_NOTHROW(calculator::calculate("a = t + 'a'", vars));
+  REQUIRE_NOTHROW(calculator::calculate("b = t + 'b'", vars));
+  REQUIRE_NOTHROW(calculator::calculate("c = a + 'c'", vars));
+  REQUIRE(vars["a"].asString() == std::string(100, 'x') + "a");
+  REQUIRE(vars["b"].asString() == std::string(100, 'x') + "b");
+  REQUIRE(vars["c"].asString() == std::string(100, 'x') + "ac");
+  REQUIRE(calculator::calculate("t + 'y' == t + 'y'", vars).asBool() == true);
+
+  // Const reads flatten it once, also from several threads:
+  REQUIRE_NOTHROW(calculator::calculate("u = t + 'b'", vars));
+  const packToken& u = vars["u"];
+  std::vector<size_t> sizes(4);
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    readers.emplace_back([&u, &sizes, i]() { sizes[i] = u.asConstString().size(); });
+  }
+  for (std::thread& reader : readers) reader.join();
+  REQUIRE(sizes == std::vector<size_t>(4, 101));
+  REQUIRE(static_cast<const Token<std::string>*>(u.token())->builder);
+
+  // Numbers are formatted as by std::ostream:
+  REQUIRE(calculator::calculate("'n: ' + 1.5").asString() == "n: 1.5");
+  REQUIRE(calculator::calculate("'n: ' + 1234567").asString() == "n: 1.23457e+06");
+  REQUIRE(calculator::calculate("2.5 + ' and'").asString() == "2.5 and");
+  REQUIRE(calculator::calculate("str(0.1)").asString() == "0.1");
+}
+
+TEST_CASE("Shared strings", "[string]") {
+  typedef Token<std::string> StrToken;
+  TokenMap vars;
+  vars["s"] = "a string";
+
+  // Copies and evaluated literals share the string:
+  packToken copy = vars["s"];
+  REQUIRE(static_cast<const StrToken*>(copy.token())->payload ==
+          static_cast<const StrToken*>(vars["s"].token())->payload);
+  calculator literal("'literal'");
+  packToken first = literal.eval();
+  packToken second = literal.eval();
+  REQUIRE(static_cast<const StrToken*>(first.token())->payload ==
+          static_cast<const StrToken*>(second.token())->payload);
+
+  // Writing to one of them copies it first:
+  copy.asString() += "!";
+  REQUIRE(copy.asConstString() == "a string!");
+  REQUIRE(vars["s"].asConstString() == "a string");
+  REQUIRE(calculator::calculate("s + s", vars).asString() == "a stringa string");
+  REQUIRE(calculator::calculate("s", vars).asString() == "a string");
+}
+
 TEST_CASE("Map access expressions", "[map][map-access]") {
   REQUIRE(calculator::calculate("map[\"key\"]", vars).asString() == "mapped value");
   REQUIRE(calculator::calculate("map[\"key\"+1]", vars).asString() ==
@@ -258,6 +421,27 @@ TEST_CASE("Prototypical inheritance tests") {
   REQUIRE(calculator::calculate("grand_child.a", vars).asDouble() == 12);
 }
 
+TEST_CASE("Child scope ownership", "[map]") {
+  TokenMap child;
+  {
+    TokenMap parent;
+    parent["a"] = 1;
+    child = parent.getChild();
+  }
+  // The child keeps its parent alive:
+  REQUIRE(child.parent() != 0);
+  REQUIRE(child.find("a")->asInt() == 1);
+  REQUIRE(TokenMap::base_map().parent() == 0);
+
+  // Copying the map data shares the parent of the source:
+  TokenMap other;
+  other["b"] = 2;
+  *static_cast<MapData_t*>(other) = *static_cast<MapData_t*>(child);
+  REQUIRE(other.find("a")->asInt() == 1);
+  REQUIRE(other.find("b") == 0);
+  REQUIRE((*other.parent() == *child.parent()));
+}
+
 TEST_CASE("Map usage expressions", "[map][map-usage]") {
   TokenMap vars;
   vars["my_map"] = TokenMap();
@@ -277,6 +461,218 @@ TEST_CASE("Map usage expressions", "[map][map-usage]") {
   REQUIRE(vars["default"].asInt() == 3);
 }
 
+TEST_CASE("Map storage", "[map]") {
+  TokenMap_t map;
+  for (int i = 0; i < 100; ++i) map[std::to_string(i)] = i;
+  packToken* first = &map["0"];
+
+  // Iteration follows the insertion order:
+  REQUIRE(map.size() == 100);
+  REQUIRE(map.begin()->first == "0");
+  int i = 0;
+  for (const auto& item : map) {
+    REQUIRE(item.first == std::to_string(i));
+    REQUIRE(item.second.asInt() == i);
+    ++i;
+  }
+
+  for (int i = 1; i < 100; i += 2) REQUIRE(map.erase(std::to_string(i)) == 1);
+  REQUIRE(map.erase("1") == 0);
+  REQUIRE(map.size() == 50);
+  REQUIRE(map.count("3") == 0);
+  REQUIRE(map.find("98")->second.asInt() == 98);
+
+  // Erased keys are appended again:
+  map["1"] = "one";
+  for (int i = 100; i < 1000; ++i) map[std::to_string(i)] = i;
+  REQUIRE(map.size() == 951);
+  REQUIRE(std::next(map.begin(), 50)->first == "1");
+  REQUIRE(map["1"].asString() == "one");
+
+  // References are kept while the table grows:
+  REQUIRE(first == &map["0"]);
+  REQUIRE(first->asInt() == 0);
+
+  TokenMap m1;
+  m1["b"] = 1;
+  m1["a"] = 2;
+  REQUIRE(packToken(m1).str() == "{ \"b\": 1, \"a\": 2 }");
+}
+
+TEST_CASE("Map shapes", "[map]") {
+  // Maps that got the same keys in the same order share their layout:
+  TokenMap_t m1, m2, m3;
+  m1["x"] = 1; m1["y"] = 2;
+  m2["x"] = 3; m2[atom_t("y")] = 4;
+  m3["y"] = 5; m3["x"] = 6;
+  REQUIRE(m1.get_shape() != 0);
+  REQUIRE(m1.get_shape() == m2.get_shape());
+  REQUIRE(m1.get_shape() != m3.get_shape());
+  REQUIRE(m1.get_shape()->keys.size() == 2);
+
+  // The shape remembers where an attribute is:
+  atom_t y("y");
+  REQUIRE(m1.find(y)->second.asInt() == 2);
+  REQUIRE(m2.find(y)->second.asInt() == 4);
+  REQUIRE(m3.find(y)->second.asInt() == 5);
+  REQUIRE(m1.find(atom_t("z")) == m1.end());
+  REQUIRE(m1.find(atom_t("z")) == m1.end());
+
+  TokenMap_t copy = m1;
+  REQUIRE(copy.get_shape() == m1.get_shape());
+  copy["x"] = 7;
+  REQUIRE(m1["x"].asInt() == 1);
+
+  // Erasing a key moves the map to its own hash table:
+  packToken* x = &m2["x"];
+  REQUIRE(m2.erase("y") == 1);
+  REQUIRE(m2.is_dictionary());
+  REQUIRE(m2.get_shape() == 0);
+  REQUIRE(m2.find(y) == m2.end());
+  REQUIRE(x == &m2["x"]);
+  REQUIRE(x->asInt() == 3);
+  REQUIRE_FALSE(m1.is_dictionary());
+
+  // So do maps with many keys:
+  TokenMap_t big;
+  for (uint32_t i = 0; i < TokenMap_t::MAX_SHAPE_KEYS; ++i) {
+    big[std::to_string(i)] = int(i);
+  }
+  packToken* first = &big["0"];
+  REQUIRE_FALSE(big.is_dictionary());
+  big["last"] = 0;
+  REQUIRE(big.is_dictionary());
+  REQUIRE(first == &big["0"]);
+  REQUIRE(std::next(big.begin(), 3)->first == "3");
+  REQUIRE(big.find(atom_t("15"))->second.asInt() == 15);
+
+  big.clear();
+  REQUIRE_FALSE(big.is_dictionary());
+  big["x"] = 1;
+  big["y"] = 1;
+  REQUIRE(big.get_shape() == m1.get_shape());
+}
+
+TEST_CASE("Bulk construction", "[list][map]") {
+  std::vector<double> values = {1, 2.5, 3};
+  TokenList L1(values.begin(), values.end());
+  REQUIRE(packToken(L1).str() == "[ 1, 2.5, 3 ]");
+
+  // Tokens are moved, not cloned:
+  TokenList_t tokens;
+  tokens.emplace_back("a");
+  tokens.emplace_back(TokenMap());
+  const TokenBase* map_token = tokens[1].token();
+  TokenList L2(std::make_move_iterator(tokens.begin()),
+               std::make_move_iterator(tokens.end()));
+  REQUIRE(L2.at(1).token() == map_token);
+
+  TokenList_t adopted;
+  adopted.emplace_back(1);
+  const TokenBase* first = adopted[0].token();
+  TokenList L3(std::move(adopted));
+  REQUIRE(L3.at(0).token() == first);
+
+  L3.reserve(10);
+  REQUIRE(L3.emplace(2).asInt() == 2);
+  REQUIRE(L3.emplace("s").asString() == "s");
+  REQUIRE(packToken(L3).str() == "[ 1, 2, \"s\" ]");
+
+  std::vector<double> numbers = {1, 2};
+  const double* data = numbers.data();
+  NumArray A(std::move(numbers));
+  REQUIRE(A.array().data() == data);
+  REQUIRE(A.sum() == 3);
+
+  // Maps keep the existing keys, like std::map:
+  std::map<std::string, double> fields = {{"x", 1}, {"y", 2}};
+  TokenMap M1;
+  M1["x"] = 0;
+  M1.insert(fields.begin(), fields.end());
+  REQUIRE(M1.map().size() == 2);
+  REQUIRE(M1["x"].asInt() == 0);
+  REQUIRE(M1["y"].asDouble() == 2);
+  REQUIRE(M1.emplace("z", 3).second);
+  REQUIRE_FALSE(M1.emplace("z", 4).second);
+  REQUIRE(M1["z"].asInt() == 3);
+
+  std::vector<std::pair<std::string, packToken>> pairs;
+  for (int i = 0; i < 20; ++i) pairs.emplace_back(std::to_string(i), TokenList());
+  const TokenBase* last = pairs.back().second.token();
+  TokenMap M2;
+  M2.reserve(pairs.size());
+  REQUIRE(M2.map().is_dictionary());
+  M2.insert(std::make_move_iterator(pairs.begin()),
+            std::make_move_iterator(pairs.end()));
+  REQUIRE(M2.map().size() == 20);
+  REQUIRE(M2.find("19")->token() == last);
+  REQUIRE(std::next(M2.map().begin(), 5)->first == "5");
+
+  TokenMap M3;
+  M3.reserve(3);
+  REQUIRE_FALSE(M3.map().is_dictionary());
+}
+
+TEST_CASE("Interned names", "[map][atom]") {
+  atom_t a1("name"), a2(std::string("na") + "me"), a3("other");
+  REQUIRE(a1 == a2);
+  REQUIRE(a1 != a3);
+  REQUIRE(a1.str() == "name");
+  REQUIRE_FALSE(atom_t());
+
+  // Keys inserted by string are found by atom and vice versa:
+  TokenMap m1;
+  m1["name"] = 1;
+  m1[a3] = 2;
+  REQUIRE(m1.find(a1)->asInt() == 1);
+  REQUIRE(m1.find("other")->asInt() == 2);
+  REQUIRE(m1.find(atom_t("missing")) == 0);
+  REQUIRE(m1.getChild().find(a3)->asInt() == 2);
+
+  // Compiled names are interned:
+  calculator c1("x = obj.name + obj['other']");
+  REQUIRE(c1.str() == "calculator { RPN: [ x, obj, \"name\", ., obj, "
+                      "\"other\", [], +, = ] }");
+  TokenMap vars;
+  vars["obj"] = m1;
+  REQUIRE(c1.eval(vars).asInt() == 3);
+  REQUIRE(vars["x"].asInt() == 3);
+  REQUIRE(calculator("obj.name = 10").eval(vars).asInt() == 10);
+  REQUIRE(m1["name"].asInt() == 10);
+}
+
+TEST_CASE("Cached scope chain lookups", "[map][atom]") {
+  atom_t name("name"), missing("missing");
+  TokenMap root;
+  root["name"] = 1;
+
+  TokenMap middle = root.getChild();
+  TokenMap leaf = middle.getChild();
+  for (int i = 0; i < 5; ++i) leaf = leaf.getChild();
+
+  REQUIRE(leaf.find(name)->asInt() == 1);
+  REQUIRE(leaf.find(name)->asInt() == 1);
+  REQUIRE(leaf.find(missing) == 0);
+  REQUIRE(leaf.find(missing) == 0);
+
+  // New keys on the chain are seen by cached lookups:
+  middle["name"] = 2;
+  root["missing"] = 3;
+  REQUIRE(leaf.find(name)->asInt() == 2);
+  REQUIRE(leaf.findMap(name) != 0);
+  REQUIRE((*leaf.findMap(name) == middle));
+  REQUIRE(leaf.find(missing)->asInt() == 3);
+
+  // And so are changed values and erased keys:
+  middle["name"] = 4;
+  REQUIRE(leaf.find(name)->asInt() == 4);
+  middle.erase("name");
+  root.erase("missing");
+  REQUIRE(leaf.find(name)->asInt() == 1);
+  REQUIRE(leaf.find(missing) == 0);
+  REQUIRE(leaf.findMap(missing) == 0);
+}
+
 TEST_CASE("List usage expressions", "[list]") {
   TokenMap vars;
   vars["my_list"] = TokenList();
@@ -331,6 +727,155 @@ TEST_CASE("List usage expressions", "[list]") {
   REQUIRE(packToken(L).str() == "[ \"my value\", 10, {} ]");
 }
 
+TEST_CASE("Copy-on-write containers", "[list][map]") {
+  GlobalScope vars;
+  REQUIRE_NOTHROW(calculator::calculate("A = [1, 2, 3]", vars));
+
+  // Copies share the items until one of them is written:
+  REQUIRE_NOTHROW(calculator::calculate("B = list(A)", vars));
+  REQUIRE_NOTHROW(calculator::calculate("C = A.copy()", vars));
+  REQUIRE_NOTHROW(calculator::calculate("D = A + []", vars));
+  TokenList A = vars["A"].asList();
+  REQUIRE(&vars["B"].asList().items() == &A.items());
+  REQUIRE(&vars["C"].asList().items() == &A.items());
+  REQUIRE(&vars["D"].asList().items() == &A.items());
+  REQUIRE(calculator::calculate("sum(B) + B.len()", vars).asInt() == 9);
+  REQUIRE(&vars["B"].asList().items() == &A.items());
+
+  REQUIRE_NOTHROW(calculator::calculate("B.push(4)", vars));
+  REQUIRE_NOTHROW(calculator::calculate("C[0] = 10", vars));
+  REQUIRE(vars["A"].str() == "[ 1, 2, 3 ]");
+  REQUIRE(vars["B"].str() == "[ 1, 2, 3, 4 ]");
+  REQUIRE(vars["C"].str() == "[ 10, 2, 3 ]");
+  REQUIRE(vars["D"].str() == "[ 1, 2, 3 ]");
+  REQUIRE(&vars["D"].asList().items() == &A.items());
+
+  // Indexing a const list reads without copying, writable ones detach:
+  TokenList F = A.copy();
+  const TokenList& read_only = F;
+  REQUIRE(read_only[1].asInt() == 2);
+  REQUIRE(&F.items() == &A.items());
+  F[1] = 20;
+  REQUIRE(&F.items() != &A.items());
+  REQUIRE(A.at(1).asInt() == 2);
+
+  // Handles still share the same list:
+  REQUIRE_NOTHROW(calculator::calculate("E = A", vars));
+  REQUIRE_NOTHROW(calculator::calculate("E.push(5)", vars));
+  REQUIRE(vars["A"].str() == "[ 1, 2, 3, 5 ]");
+  REQUIRE(vars["D"].str() == "[ 1, 2, 3 ]");
+
+  // Iterators keep a snapshot of the items:
+  Iterator* it = A.getIterator();
+  A.push(6);
+  int count = 0;
+  while (it->next()) ++count;
+  delete it;
+  REQUIRE(count == 4);
+  REQUIRE(A.items().size() == 5);
+
+  // Maps are copied with the same parent:
+  REQUIRE_NOTHROW(calculator::calculate("M = {'a': 1}", vars));
+  REQUIRE_NOTHROW(calculator::calculate("N = M.copy()", vars));
+  REQUIRE_NOTHROW(calculator::calculate("N.b = 2", vars));
+  REQUIRE(vars["M"].str() == "{ \"a\": 1 }");
+  REQUIRE(vars["N"].str() == "{ \"a\": 1, \"b\": 2 }");
+  REQUIRE(vars["N"].asMap().parent() != 0);
+  REQUIRE((*vars["N"].asMap().parent() == *vars["M"].asMap().parent()));
+}
+
+TEST_CASE("List and string slices", "[list][slice]") {
+  GlobalScope vars;
+  REQUIRE_NOTHROW(calculator::calculate("L = [0, 1, 2, 3, 4, 5]", vars));
+
+  REQUIRE(calculator::calculate("L[1:4]", vars).str() == "[ 1, 2, 3 ]");
+  REQUIRE(calculator::calculate("L[1:5:2]", vars).str() == "[ 1, 3 ]");
+  REQUIRE(calculator::calculate("L[:2]", vars).str() == "[ 0, 1 ]");
+  REQUIRE(calculator::calculate("L[4:]", vars).str() == "[ 4, 5 ]");
+  REQUIRE(calculator::calculate("L[::3]", vars).str() == "[ 0, 3 ]");
+  REQUIRE(calculator::calculate("L[::-2]", vars).str() == "[ 5, 3, 1 ]");
+  REQUIRE(calculator::calculate("L[-2:]", vars).str() == "[ 4, 5 ]");
+  REQUIRE(calculator::calculate("L[10:]", vars).str() == "[]");
+  REQUIRE(calculator::calculate("L[1:][::2][1]", vars).asInt() == 3);
+  REQUIRE(calculator::calculate("sum(L[2:4]) + L[2:4].len()", vars).asInt() == 7);
+  REQUIRE(calculator::calculate("(1, 2, 3)[1:]", vars).str() == "(2, 3)");
+  REQUIRE_THROWS_AS(calculator::calculate("L[::0]", vars), const std::domain_error&);
+
+  // Slices share the items until written:
+  REQUIRE_NOTHROW(calculator::calculate("S = L[1:4]", vars));
+  TokenList S = vars["S"].asList();
+  REQUIRE(S.size() == 3);
+  REQUIRE(&S.at(0) == &vars["L"].asList().items()[1]);
+
+  REQUIRE_NOTHROW(calculator::calculate("S[0] = 10", vars));
+  REQUIRE_NOTHROW(calculator::calculate("L.push(6)", vars));
+  REQUIRE(vars["S"].str() == "[ 10, 2, 3 ]");
+  REQUIRE(vars["L"].str() == "[ 0, 1, 2, 3, 4, 5, 6 ]");
+
+  // Iterating a slice:
+  REQUIRE(calculator::calculate("list(L[::-3])", vars).str() == "[ 6, 3, 0 ]");
+
+  // Strings:
+  REQUIRE(calculator::calculate("'abcdef'[1:4]", vars).asString() == "bcd");
+  REQUIRE(calculator::calculate("'abcdef'[::-2]", vars).asString() == "fdb");
+  REQUIRE(calculator::calculate("'abcdef'[-2:]", vars).asString() == "ef");
+}
+
+TEST_CASE("Numeric arrays", "[array]") {
+  GlobalScope vars;
+  REQUIRE_NOTHROW(calculator::calculate("A = array(1, 2, 3, 4, 5)", vars));
+  REQUIRE_NOTHROW(calculator::calculate("B = array([5, 4, 3, 2, 1])", vars));
+  REQUIRE(vars["A"]->type == NUM_ARRAY);
+  REQUIRE(vars["A"].str() == "array(1, 2, 3, 4, 5)");
+  REQUIRE(calculator::calculate("type(A)", vars).asString() == "array");
+
+  // Elementwise operations:
+  REQUIRE(calculator::calculate("A + B", vars).str() == "array(6, 6, 6, 6, 6)");
+  REQUIRE(calculator::calculate("A - 1", vars).str() == "array(0, 1, 2, 3, 4)");
+  REQUIRE(calculator::calculate("10 * A", vars).str() == "array(10, 20, 30, 40, 50)");
+  REQUIRE(calculator::calculate("A / 2", vars).str() == "array(0.5, 1, 1.5, 2, 2.5)");
+  REQUIRE(calculator::calculate("-A", vars).str() == "array(-1, -2, -3, -4, -5)");
+  REQUIRE(calculator::calculate("A < B", vars).str() == "array(1, 1, 0, 0, 0)");
+  REQUIRE(calculator::calculate("A >= 3", vars).str() == "array(0, 0, 1, 1, 1)");
+  REQUIRE(calculator::calculate("A == array(1, 2, 3, 4, 5)", vars).asBool() == true);
+  REQUIRE(calculator::calculate("(A - 1) * 2 + A", vars).str() == "array(1, 4, 7, 10, 13)");
+  REQUIRE(vars["A"].str() == "array(1, 2, 3, 4, 5)");
+  REQUIRE_THROWS_AS(calculator::calculate("A + array(1, 2)", vars), const std::domain_error&);
+  REQUIRE_THROWS_AS(calculator::calculate("A % 2", vars), const undefined_operation&);
+
+  // Temporary results are overwritten, but not the variables:
+  REQUIRE_NOTHROW(calculator::calculate("C = A * 2", vars));
+  REQUIRE(calculator::calculate("C + C", vars).str() == "array(4, 8, 12, 16, 20)");
+  REQUIRE(vars["C"].str() == "array(2, 4, 6, 8, 10)");
+
+  // Indexing:
+  REQUIRE(calculator::calculate("A[0]", vars).asDouble() == 1);
+  REQUIRE(calculator::calculate("A[-1]", vars).asDouble() == 5);
+  REQUIRE_THROWS(calculator::calculate("A[5]", vars));
+  REQUIRE_NOTHROW(calculator::calculate("A[1] = 20", vars));
+  REQUIRE(vars["A"].str() == "array(1, 20, 3, 4, 5)");
+
+  // Attributes and conversions:
+  REQUIRE(calculator::calculate("A.len()", vars).asInt() == 5);
+  REQUIRE(calculator::calculate("A.sum()", vars).asDouble() == 33);
+  REQUIRE(calculator::calculate("sum(A > 2)", vars).asDouble() == 4);
+  REQUIRE(calculator::calculate("A.list()", vars).str() == "[ 1, 20, 3, 4, 5 ]");
+  REQUIRE(calculator::calculate("list(B)", vars).str() == "[ 5, 4, 3, 2, 1 ]");
+  REQUIRE(calculator::calculate("array(B)", vars).str() == "array(5, 4, 3, 2, 1)");
+  REQUIRE(calculator::calculate("array()", vars).str() == "array()");
+  REQUIRE_THROWS_AS(calculator::calculate("array(1, 'a')", vars), const bad_cast&);
+
+  // Lists are not affected by the array operations:
+  REQUIRE(calculator::calculate("[1, 2] + [3]", vars).str() == "[ 1, 2, 3 ]");
+  REQUIRE(calculator::calculate("[1, 2][1]", vars).asInt() == 2);
+
+  // Arrays bound at compile time are serialized:
+  calculator c1("B * 2", vars), c2;
+  std::string data = c1.dump();
+  REQUIRE_NOTHROW(c2.load(data.data(), data.size()));
+  REQUIRE(c2.eval().str() == "array(10, 8, 6, 4, 2)");
+}
+
 TEST_CASE("Tuple usage expressions", "[tuple]") {
   TokenMap vars;
   calculator c;
@@ -446,6 +991,67 @@ TEST_CASE("Test map iterable behavior") {
   delete it;
 }
 
+TEST_CASE("Lazy iterators", "[iterator]") {
+  GlobalScope vars;
+  REQUIRE(calculator::calculate("list(range(4))").str() == "[ 0, 1, 2, 3 ]");
+  REQUIRE(calculator::calculate("list(range(1, 8, 3))").str() == "[ 1, 4, 7 ]");
+  REQUIRE(calculator::calculate("list(range(3, 0, -1))").str() == "[ 3, 2, 1 ]");
+  REQUIRE(calculator::calculate("list(range(0))").str() == "[]");
+  REQUIRE_THROWS(calculator::calculate("range(1, 2, 0)"));
+  REQUIRE_THROWS(calculator::calculate("range()"));
+
+  // The last step must not overflow near the int64 limits:
+  TokenMap limits;
+  limits["max"] = std::numeric_limits<int64_t>::max();
+  limits["min"] = std::numeric_limits<int64_t>::min();
+  limits["below_max"] = std::numeric_limits<int64_t>::max() - 1;
+  limits["above_min"] = std::numeric_limits<int64_t>::min() + 1;
+  REQUIRE(calculator::calculate("list(range(below_max, max, 5))", limits).str() ==
+          "[ 9223372036854775806 ]");
+  REQUIRE(calculator::calculate("list(range(above_min, min, -5))", limits).str() ==
+          "[ -9223372036854775807 ]");
+  REQUIRE(calculator::calculate("len(list(range(min, max, max)))", limits).asInt() == 4);
+
+  REQUIRE(calculator::calculate("list(map(abs, range(-2, 1)))").str() == "[ 2, 1, 0 ]");
+  REQUIRE(calculator::calculate("list(filter(None, range(-1, 2)))").str() == "[ -1, 1 ]");
+  REQUIRE(calculator::calculate("list(filter(abs, [0, 2, 0, -3]))").str() == "[ 2, -3 ]");
+  REQUIRE(calculator::calculate("list(zip(range(3), ['a', 'b']))").str() ==
+          "[ (0, \"a\"), (1, \"b\") ]");
+  REQUIRE(calculator::calculate("list(zip())").str() == "[]");
+  REQUIRE(calculator::calculate("list(enumerate(['a', 'b'], 1))").str() ==
+          "[ (1, \"a\"), (2, \"b\") ]");
+  REQUIRE(calculator::calculate("reduce(pow, [2, 3, 2])").asDouble() == 64);
+  REQUIRE(calculator::calculate("reduce(pow, range(0), 5)").asInt() == 5);
+  REQUIRE_THROWS(calculator::calculate("reduce(pow, range(0))"));
+  REQUIRE_THROWS(calculator::calculate("list(map(abs, 10))"));
+
+  // `map` keeps working as the map constructor:
+  REQUIRE(calculator::calculate("map(a: 1)").str() == "{ \"a\": 1 }");
+  REQUIRE(calculator::calculate("map()").str() == "{}");
+
+  // Consumers accept any iterable and read it item by item:
+  REQUIRE(calculator::calculate("sum(filter(None, range(100000)))").asDouble() == 4999950000.0);
+  REQUIRE(calculator::calculate("sum(map(abs, range(-3, 0)))").asDouble() == 6);
+  REQUIRE(calculator::calculate("map(str, range(3)).join(', ')").asString() == "0, 1, 2");
+  REQUIRE(calculator::calculate("array(range(3))").str() == "array(0, 1, 2)");
+  REQUIRE(calculator::calculate("[].join(',')").asString() == "");
+
+  // Iterators compute their items again when copied or reset:
+  REQUIRE_NOTHROW(calculator::calculate("it = map(abs, range(-2, 0))", vars));
+  REQUIRE(calculator::calculate("list(it)", vars).str() == "[ 2, 1 ]");
+  REQUIRE(calculator::calculate("list(it)", vars).str() == "[ 2, 1 ]");
+  REQUIRE(calculator::calculate("type(it)", vars).asString() == "iterable");
+
+  Iterator* it = static_cast<Iterator*>(vars["it"]->clone());
+  REQUIRE(it->next()->asInt() == 2);
+  REQUIRE(it->next()->asInt() == 1);
+  REQUIRE(it->next() == 0);
+  REQUIRE(it->next()->asInt() == 2);
+  it->reset();
+  REQUIRE(it->next()->asInt() == 2);
+  delete it;
+}
+
 TEST_CASE("Function usage expressions") {
   GlobalScope vars;
   vars["pi"] = 3.141592653589793;
@@ -684,6 +1290,72 @@ TEST_CASE("Scope management") {
   REQUIRE(calculator::calculate("pi+b1+b2", copy).asDouble() == Approx(3.0));
 }
 
+// Reads the fields of a record by name, counting the calls:
+struct recordResolver : public VariableResolver {
+  std::map<std::string, packToken> fields;
+  std::map<std::string, int> calls;
+
+  bool resolve(const std::string& name, packToken* value) {
+    ++calls[name];
+    auto it = fields.find(name);
+    if (it == fields.end()) return false;
+    *value = it->second;
+    return true;
+  }
+};
+
+TEST_CASE("Variable resolvers", "[map][resolver]") {
+  std::shared_ptr<recordResolver> record = std::make_shared<recordResolver>();
+  record->fields["price"] = 2.5;
+  record->fields["qty"] = 4;
+  record->fields["unused"] = 0;
+  TokenMap inner;
+  inner["x"] = 1;
+  record->fields["inner"] = inner;
+
+  TokenMap vars;
+  vars["qty"] = 3;
+  vars.set_resolver(record);
+
+  // Only the names missing on the map are resolved, once:
+  calculator c("price * qty + inner.x");
+  REQUIRE(c.eval(vars).asDouble() == 8.5);
+  REQUIRE(c.eval(vars).asDouble() == 8.5);
+  REQUIRE(record->calls["price"] == 1);
+  REQUIRE(record->calls.count("qty") == 0);
+  REQUIRE(record->calls.count("unused") == 0);
+  REQUIRE(vars.map().size() == 3);
+
+  // Undefined names are searched on the parent scopes,
+  // and requested again on each lookup:
+  REQUIRE(calculator::calculate("abs(-price)", vars).asDouble() == 2.5);
+  REQUIRE(record->calls["abs"] == 2);
+  REQUIRE(vars.find("missing") == 0);
+
+  // Assignments don't change the record:
+  REQUIRE(calculator::calculate("unused = 5", vars).asInt() == 5);
+  REQUIRE(vars["unused"].asInt() == 5);
+  REQUIRE(record->fields["unused"].asInt() == 0);
+
+  // Child scopes, lookups by string and compile time binding see them too:
+  TokenMap child = vars.getChild();
+  REQUIRE(calculator::calculate("price + 1", child).asDouble() == 3.5);
+  record->fields["late"] = 7;
+  REQUIRE(child.find("late")->asInt() == 7);
+  REQUIRE(child.findMap("late") != 0);
+  REQUIRE((*child.findMap("late") == vars));
+  record->fields["bound"] = 5;
+  calculator c2("bound * 2", child);
+  record->fields.clear();
+  REQUIRE(c2.eval().asInt() == 10);
+
+  // Misses on the parent scopes are requested again too:
+  calculator c3("later");
+  REQUIRE(c3.eval(child)->type == VAR);
+  record->fields["later"] = 42;
+  REQUIRE(c3.eval(child).asInt() == 42);
+}
+
 // Working as a slave parser implies it will return
 // a pointer to the place it has stopped parsing
 // and accept a list of delimiters that should make it stop.
@@ -728,6 +1400,177 @@ TEST_CASE("Parsing as slave parser") {
   REQUIRE_THROWS(calculator::calculate(error_test, vars, "\n;", &code));
 }
 
+TEST_CASE("Script compilation", "[script]") {
+  const char* code = "a = 1; b = 2\n\n  c = a + b # sum\n;;\n d = (\n c *\n 4\n)\n";
+  TokenMap scope;
+  script s1;
+
+  REQUIRE_NOTHROW(s1.compile(code, scope));
+  REQUIRE(s1.size() == 4);
+  REQUIRE(s1[0].offset == 0);
+  REQUIRE(s1[1].offset == 7);
+  REQUIRE(s1[2].offset == 16);
+  REQUIRE(s1[3].offset == 36);
+
+  REQUIRE(s1.eval(scope) == 12);
+  REQUIRE(scope["c"] == 3);
+
+  // Single statements and copies:
+  scope["a"] = 10;
+  REQUIRE(s1.eval(s1[2], scope) == 12);
+  script copy(s1);
+  REQUIRE(copy.size() == 4);
+  REQUIRE(copy.eval(copy[3], scope) == 48);
+
+  // Statements compiled before an error are kept:
+  script s2;
+  REQUIRE_THROWS(s2.compile("1\n'unterminated\n3"));
+  REQUIRE(s2.size() == 1);
+
+  // Reading from a file:
+  const char* path = "test-script.tmp";
+  std::ofstream(path) << code;
+
+  script s3;
+  REQUIRE_NOTHROW(s3.compile_file(path, scope));
+  REQUIRE(s3.size() == 4);
+  REQUIRE(s3[3].offset == 36);
+  REQUIRE(s3.eval(scope) == 12);
+
+  // A file ending exactly on a page boundary:
+  std::ofstream(path) << "e = 42" << std::string(4096 - 6, ' ');
+
+  script s4;
+  REQUIRE_NOTHROW(s4.compile_file(path, scope));
+  REQUIRE(s4.size() == 1);
+  REQUIRE(s4.eval(scope) == 42);
+
+  std::remove(path);
+  REQUIRE_THROWS(s4.compile_file(path, scope));
+
+  // Moved-from calculators evaluate to None:
+  calculator c1("1 + 2");
+  calculator c2(std::move(c1));
+  REQUIRE(c2.eval().asInt() == 3);
+  REQUIRE(c1.eval()->type == NONE);
+  c1 = std::move(c2);
+  REQUIRE(c1.eval().asInt() == 3);
+  REQUIRE(c2.eval()->type == NONE);
+}
+
+TEST_CASE("Parallel script compilation", "[script][thread]") {
+  // Statements with brackets, strings and comments
+  // containing the delimiter characters:
+  std::string code;
+  for (int i = 0; i < 5000; ++i) {
+    std::string n = std::to_string(i);
+    code += "x" + n + " = (1 +\n " + n + ") * 2; s = 'a;b\\'\\n'";
+    code += " # comment; (\n /* ; \n */ y = [\n" + n + ", {'k': \"\\\";\"}]\n";
+  }
+
+  TokenMap scope1, scope2;
+  script s1, s2;
+  REQUIRE_NOTHROW(s1.compile(code.c_str(), scope1));
+  REQUIRE_NOTHROW(s2.compile(code.c_str(), scope2, "\n;", 4));
+  REQUIRE(s1.size() == 15000);
+  REQUIRE(s2.size() == s1.size());
+
+  bool same_offsets = true;
+  for (size_t i = 0; i < s1.size(); ++i) {
+    same_offsets = same_offsets && s1[i].offset == s2[i].offset;
+  }
+  REQUIRE(same_offsets);
+
+  REQUIRE_NOTHROW(s2.eval(scope2));
+  REQUIRE(scope2["x4999"] == 2 * (1 + 4999));
+  REQUIRE(scope2["s"] == "a;b'\n");
+  REQUIRE(scope2["y"].asList()[1]["k"] == "\";");
+
+  // Errors are reported in source order:
+  code += "z = 'unterminated\n";
+  code += code;
+  script s3;
+  REQUIRE_THROWS(s3.compile(code.c_str(), scope2, "\n;", 4));
+  REQUIRE(s3.size() == 15000);
+}
+
+TEST_CASE("Binary serialization of calculators", "[dump]") {
+  calculator c1("[1, 'x', 2.5, True, None, (1, 2)]");
+  calculator c2("{'a': -10}.a * pi + sqrt(16) - b", vars);
+  calculator c3, c4;
+
+  std::string data = c1.dump();
+  REQUIRE(c3.load(data.data(), data.size()) == data.size());
+  REQUIRE(c3.eval().str() == c1.eval().str());
+  REQUIRE(c3.str() == c1.str());
+
+  // Concatenated programs:
+  data = c2.dump() + c1.dump();
+  size_t size = 0;
+  REQUIRE_NOTHROW(size = c3.load(data.data(), data.size()));
+  REQUIRE_NOTHROW(c4.load(data.data() + size, data.size() - size));
+
+  TokenMap scope;
+  scope["b"] = 1;
+  REQUIRE(c3.eval(scope).asDouble() == Approx(-10 * 3.14 + 4 - 1));
+  REQUIRE(c4.eval().str() == c1.eval().str());
+
+  // Invalid data:
+  REQUIRE_THROWS(c3.load("CPRX", 4));
+  REQUIRE_THROWS(c3.load(data.data(), size - 1));
+  data[4] = 2;
+  REQUIRE_THROWS(c3.load(data.data(), data.size()));
+
+  // Functions are loaded by name from the builtins scope:
+  TokenMap builtins(0);
+  data = calculator("sqrt(4)").dump();
+  REQUIRE_THROWS(c3.load(data.data(), data.size(), builtins));
+  builtins["sqrt"] = TokenMap::default_global()["abs"];
+  REQUIRE_NOTHROW(c3.load(data.data(), data.size(), builtins));
+  REQUIRE(c3.eval(builtins) == 4);
+
+  // The program is unchanged after a failed load:
+  REQUIRE(c4.eval().str() == c1.eval().str());
+
+  // Scripts:
+  const char* code = "x = 2\n y = x * 3; z = [x, y]\n";
+  script s1, s2;
+  s1.compile(code);
+  data = s1.dump();
+  REQUIRE(s2.load(data.data(), data.size()) == data.size());
+  REQUIRE(s2.size() == 3);
+  REQUIRE(s2[2].offset == s1[2].offset);
+  REQUIRE(s2.eval(scope).str() == "[ 2, 6 ]");
+
+  const char* path = "test-script.tmp";
+  std::ofstream(path, std::ios::binary) << data;
+  script s3;
+  REQUIRE_NOTHROW(s3.load_file(path));
+  std::remove(path);
+  REQUIRE(s3.size() == 3);
+
+  // Equal strings of different statements share their payload:
+  script s4;
+  s4.compile("'shared'\n 'shared'");
+  data = s4.dump();
+  REQUIRE_NOTHROW(s3.load(data.data(), data.size()));
+  packToken str1 = s3.eval(s3[3]);
+  packToken str2 = s3.eval(s3[4]);
+  REQUIRE(str1 == "shared");
+  REQUIRE(&str1.asConstString() == &str2.asConstString());
+
+  // Tokens can't be nested without limit:
+  std::string nested("CPRN\x01\0\0\0" "\0\0\0\0" "\x01\0\0\0", 16);
+  for (int i = 0; i < 100000; ++i) {
+    nested += std::string("\x41\x01\0\0\0", 5);  // A list of one item.
+  }
+  nested += '\0';
+  REQUIRE_THROWS_WITH(c3.load(nested.data(), nested.size()),
+                      "Tokens nested too deeply on binary data!");
+  nested = nested.substr(0, 16 + 5 * 255) + '\0';
+  REQUIRE_NOTHROW(c3.load(nested.data(), nested.size()));
+}
+
 // This function is for internal use only:
 TEST_CASE("operation_id() function", "[op_id]") {
   #define opID(t1, t2) Operation::build_mask(t1, t2)
@@ -745,7 +1588,7 @@ struct myCalc : public calculator {
     return conf;
   }
 
-  const Config_t Config() const { return my_config(); }
+  const Config_t& Config() const { return my_config(); }
 
   using calculator::calculator;
 };
@@ -1032,6 +1875,38 @@ TEST_CASE("Adhoc reservedWord parsers", "[parser][config]") {
   REQUIRE(c1.eval().asInt() == 4);
 }
 
+TEST_CASE("Operator lexicon", "[operator][config]") {
+  myCalc c1;
+
+  // Unknown operator sequences are split on their longest known prefix:
+  REQUIRE_NOTHROW(c1.compile("2*~10"));
+  REQUIRE(c1.eval().asInt() == 2 * ~10l);
+
+  REQUIRE_NOTHROW(c1.compile("10~*3"));
+  REQUIRE(c1.eval().asInt() == ~10l * 3);
+
+  REQUIRE(calculator::calculate("1+-1").asInt() == 0);
+  REQUIRE(calculator::calculate("2*-(1+2)").asInt() == -6);
+  REQUIRE_THROWS(calculator::calculate("1 @ 1"));
+
+  // Changes to the config must be seen by the next parse:
+  Config_t conf = calculator::Default();
+  REQUIRE(calculator("5 - 2", vars, 0, 0, conf).eval() == 3);
+  REQUIRE_THROWS(calculator("5 <> 2", vars, 0, 0, conf));
+
+  conf.opPrecedence.add("<>", 5);
+  REQUIRE_NOTHROW(calculator("5 <> 2", vars, 0, 0, conf));
+
+  // The parser map is only changed by add(), which updates its version:
+  uint64_t version = conf.parserMap.version();
+  conf.parserMap.add("minus", &slash_slash);
+  REQUIRE(conf.parserMap.version() != version);
+  REQUIRE(calculator("5 minus 2", vars, 0, 0, conf).eval() == 3);
+
+  // The original config must not be affected:
+  REQUIRE_THROWS(calculator::calculate("5 <> 2"));
+}
+
 TEST_CASE("Custom parser for operator ':'", "[parser]") {
   packToken p1;
   calculator c2;
@@ -1059,6 +1934,52 @@ TEST_CASE("Resource management") {
   REQUIRE_NOTHROW(C1 = C2);
 }
 
+TEST_CASE("Cycle collector", "[gc]") {
+  CycleCollector::enable();
+  CycleCollector::collect();
+
+  {
+    TokenMap vars;
+    calculator::calculate("a = map()", vars);
+    calculator::calculate("a.self = a", vars);
+    TokenList list;
+    list.push(list);
+    list.push(vars["a"]);
+  }
+
+  // The map and the list only reference each other:
+  CycleCollector::result_t result = CycleCollector::collect();
+  REQUIRE(result.containers == 2);
+  REQUIRE(result.bytes > sizeof(MapData_t) + sizeof(ListData_t));
+  REQUIRE(CycleCollector::collect().containers == 0);
+
+  // Cycles still referenced are kept:
+  TokenMap live;
+  live["self"] = live;
+  live["child"] = live.getChild();
+  live["child"]["list"] = TokenList();
+  live["child"]["list"].asList().push(live["child"]);
+  REQUIRE(CycleCollector::collect().containers == 0);
+  REQUIRE((live["self"].asMap() == live));
+  REQUIRE(live["child"]["list"].asList().size() == 1);
+
+  // Past the threshold it only runs when the host asks for it:
+  size_t collected = CycleCollector::total().containers;
+  CycleCollector::set_threshold(100);
+  live.erase("child");
+  live.erase("self");
+  for (int i = 0; i < 99; ++i) TokenList();
+  CycleCollector::collect_if_needed();
+  REQUIRE(CycleCollector::total().containers == collected);
+  TokenList();
+  REQUIRE(calculator::calculate("1 + 1").asInt() == 2);
+  REQUIRE(CycleCollector::total().containers == collected);
+  CycleCollector::collect_if_needed();
+  REQUIRE(CycleCollector::total().containers == collected + 2);
+  CycleCollector::set_threshold(0);
+  CycleCollector::enable(false);
+}
+
 /* * * * * Testing adhoc operator parser * * * * */
 
 TEST_CASE("Adhoc operator parser", "[operator]") {
@@ -1119,6 +2040,219 @@ TEST_CASE("Exception management") {
   REQUIRE_THROWS(ecalc2.compile("map(['hello']]"));
 }
 
+TEST_CASE("Binding variables by reference", "[config]") {
+  Config_t conf = calculator::Default();
+  conf.bindMode = BIND_BY_REFERENCE;
+
+  TokenMap v1;
+  v1["a"] = 10;
+  v1["items"] = TokenList();
+  v1["items"].asList().push(1);
+
+  calculator c1("a + items[0]", v1, 0, 0, conf);
+  calculator c2("a + items[0]", v1);
+
+  // No values are copied into the RPN:
+  REQUIRE(c1.str() == "calculator { RPN: [ a, items, 0, [], + ] }");
+  REQUIRE(c1.eval().asInt() == 11);
+  REQUIRE(c2.eval().asInt() == 11);
+
+  // The bound scope is read when evaluating:
+  v1["a"] = 20;
+  v1["items"].asList()[0] = 2;
+  REQUIRE(c1.eval().asInt() == 22);
+  // Only the list is shared with the by value binding:
+  REQUIRE(c2.eval().asInt() == 12);
+
+  // The evaluation scope comes first:
+  TokenMap v2;
+  v2["a"] = 100;
+  REQUIRE(c1.eval(v2).asInt() == 102);
+
+  // Copies keep the binding:
+  calculator c3 = c1;
+  v1["a"] = 30;
+  REQUIRE(c3.eval().asInt() == 32);
+
+  // Assignments still go to the evaluation scope:
+  calculator c4("a = a + 1", v1, 0, 0, conf);
+  REQUIRE(c4.eval(v2).asInt() == 101);
+  REQUIRE(v2["a"].asInt() == 101);
+  REQUIRE(v1["a"].asInt() == 30);
+
+  // And so do script statements:
+  script s1(conf);
+  s1.compile("a * 2; a + 1", v1, ";", 1);
+  v1["a"] = 40;
+  REQUIRE(s1.eval(s1[0]).asInt() == 80);
+  REQUIRE(s1.eval().asInt() == 41);
+}
+
+// Removes the characters of `right` from `left`:
+packToken string_minus(const packToken& left, const packToken& right,
+                       evaluationData* data) {
+  if (data->op != "-") return Operation::reject(data);
+
+  std::string result;
+  for (char c : left.asConstString()) {
+    if (right.asConstString().find(c) == std::string::npos) result += c;
+  }
+  return result;
+}
+
+TEST_CASE("Non-throwing compile and eval", "[error]") {
+  calculator c1("1 + 2");
+  packToken result;
+
+  calcError_t error = c1.try_compile("1 + 2)");
+  REQUIRE(error.code == calcError_t::SYNTAX_ERROR);
+  REQUIRE(error.message() == "Extra '(' on the expression!");
+  REQUIRE(c1.try_compile("2 +* 1").message() ==
+          "Unrecognized unary operator: '*'.");
+  REQUIRE(c1.try_compile("'abc").message() ==
+          "Expected quote (') at end of string declaration: 'abc.");
+  REQUIRE(c1.try_compile("   ").code == calcError_t::INVALID_ARGUMENT);
+
+  // A failed compilation keeps the previous RPN:
+  REQUIRE(c1.str() == "calculator { RPN: [ 1, 2, + ] }");
+  REQUIRE_FALSE(c1.try_eval(&result));
+  REQUIRE(result.asInt() == 3);
+
+  REQUIRE_FALSE(c1.try_compile("print + 1"));
+  error = c1.try_eval(&result);
+  REQUIRE(error.code == calcError_t::UNDEFINED_OPERATION);
+  REQUIRE(error.message() == "Unexpected operation with operator '+' "
+                             "and operands: [Function: print] and 1.");
+  REQUIRE(result.asInt() == 3);
+
+  // Also when the builtin operations reject the operands:
+  TokenMap v1;
+  v1["a"] = "x";
+  v1["b"] = "y";
+  REQUIRE_FALSE(c1.try_compile("a - b"));
+  error = c1.try_eval(&result, v1);
+  REQUIRE(error.code == calcError_t::UNDEFINED_OPERATION);
+  REQUIRE(error.message() == "Unexpected operation with operator '-' "
+                             "and operands: \"x\" and \"y\".");
+
+  // So operations added after them are still tried:
+  Config_t conf = calculator::Default();
+  conf.opMap.add({STR, ANY_OP, STR}, &string_minus);
+  script s1(conf);
+  s1.compile("'abc' - 'b'");
+  REQUIRE(s1.eval() == "ac");
+
+  // Including operands that only share the type mask:
+  calculator c2("{} - 1");
+  REQUIRE(c2.try_eval(&result).code == calcError_t::UNDEFINED_OPERATION);
+  c2.compile("'a'.nope");
+  REQUIRE(c2.try_eval(&result).code == calcError_t::UNDEFINED_OPERATION);
+  c2.compile("array(1, 2) % 2");
+  REQUIRE(c2.try_eval(&result).code == calcError_t::UNDEFINED_OPERATION);
+
+  // Exceptions thrown by functions are kept as they are:
+  REQUIRE_FALSE(c1.try_compile("float('abc')"));
+  error = c1.try_eval(&result);
+  REQUIRE(error.code == calcError_t::EXCEPTION);
+  REQUIRE(error.message() == "Could not convert \"abc\" to float!");
+  REQUIRE_THROWS_AS(error.raise(), const std::runtime_error&);
+
+  // Operations skipped with Operation::reject() don't count as errors:
+  REQUIRE_FALSE(c1.try_compile("m.a + 'x'.len()"));
+  TokenMap v2;
+  v2["m"] = TokenMap();
+  v2["m"]["a"] = 10;
+  REQUIRE_FALSE(c1.try_eval(&result, v2));
+  REQUIRE(result.asInt() == 11);
+
+  // The throwing API reports the same errors:
+  REQUIRE_THROWS_AS(calculator("1 + 2)"), const syntax_error&);
+  REQUIRE_THROWS_AS(calculator("   "), const std::invalid_argument&);
+  REQUIRE_THROWS_AS(calculator("a - b").eval(v1), const undefined_operation&);
+}
+
+packToken nested_sum(TokenMap scope) {
+  return calculator::calculate("1 + 1 + 1 + 1");
+}
+
+TEST_CASE("Evaluation budgets", "[budget]") {
+  calculator c1("1 + 2 * 3");
+  evalBudget_t budget;
+  packToken result;
+
+  // The RPN has 5 tokens:
+  budget.max_steps = 4;
+  c1.set_budget(budget);
+  REQUIRE_THROWS_AS(c1.eval(), const budget_exceeded&);
+  calcError_t error = c1.try_eval(&result);
+  REQUIRE(error.code == calcError_t::BUDGET_EXCEEDED);
+  REQUIRE(error.message() == "Evaluation exceeded its step budget.");
+
+  // The usage is reset on each evaluation:
+  budget.max_steps = 5;
+  c1.set_budget(budget);
+  REQUIRE(c1.eval().asInt() == 7);
+  REQUIRE(c1.eval().asInt() == 7);
+  REQUIRE(calculator(c1).budget().max_steps == 5);
+
+  // Bytes are checked before allocating:
+  TokenMap vars;
+  vars["s"] = std::string(100, 'x');
+  calculator c2("s + s + s", vars);
+  budget = evalBudget_t();
+  budget.max_bytes = 250;
+  c2.set_budget(budget);
+  REQUIRE_THROWS_AS(c2.eval(vars), const budget_exceeded&);
+  REQUIRE(c2.try_eval(&result, vars).code == calcError_t::BUDGET_EXCEEDED);
+  budget.max_bytes = 500;
+  c2.set_budget(budget);
+  REQUIRE(c2.eval(vars).asString().size() == 300);
+
+  budget = evalBudget_t();
+  budget.max_tokens = 10;
+  calculator c3("list(1, 2, 3, 4, 5, 6, 7, 8, 9, 10)");
+  c3.set_budget(budget);
+  REQUIRE_THROWS_AS(c3.eval(), const budget_exceeded&);
+
+  // A single call, even as the last step, stops at the limits:
+  budget = evalBudget_t();
+  budget.max_tokens = 1000;
+  calculator c4("list(range(20000000))");
+  c4.set_budget(budget);
+  REQUIRE_THROWS_AS(c4.eval(), const budget_exceeded&);
+  budget = evalBudget_t();
+  budget.max_bytes = 1000;
+  c4.set_budget(budget);
+  REQUIRE(c4.try_eval(&result).code == calcError_t::BUDGET_EXCEEDED);
+  c4 = calculator("sum(range(20000000))");
+  budget = evalBudget_t();
+  budget.max_tokens = 1000;
+  c4.set_budget(budget);
+  REQUIRE_THROWS_AS(c4.eval(), const budget_exceeded&);
+  c4 = calculator("map(str, range(100)).join(',')");
+  budget = evalBudget_t();
+  budget.max_bytes = 100;
+  c4.set_budget(budget);
+  REQUIRE_THROWS_AS(c4.eval(), const budget_exceeded&);
+
+  // A scope limits every evaluation on the thread,
+  // including nested ones on function calls:
+  vars["nested_sum"] = CppFunction(&nested_sum);
+  evalBudget_t limits;
+  limits.max_steps = 100;
+  {
+    evalBudget_t::scope_t scope(&limits);
+    REQUIRE(calculator::calculate("nested_sum() + 1", vars).asInt() == 5);
+    REQUIRE(limits.steps == 5 + 7);
+    REQUIRE(limits.tokens > 0);
+
+    limits.max_steps = limits.steps + 8;
+    REQUIRE_THROWS_AS(calculator::calculate("nested_sum() + 1", vars),
+                      const budget_exceeded&);
+  }
+  REQUIRE(calculator::calculate("nested_sum() + 1", vars).asInt() == 5);
+}
+
 TEST_CASE("Variable UTF8 name support") {
   TokenMap v1;
   v1["n_"] = 5; // Normal name
@@ -1157,6 +2291,33 @@ TEST_CASE("Variable UTF8 name support") {
   REQUIRE(calc.eval().asInt() == 10);
 }
 
+TEST_CASE("Lexer character classes and delimiters", "[lexer]") {
+  TokenMap v1;
+  v1["a_very_long_variable_name_0123456789"] = 1;
+  v1["long_ascii_prefix_€_and_suffix_abcdefgh"] = 2;
+  REQUIRE(calculator::calculate("a_very_long_variable_name_0123456789 + 1", v1).asInt() == 2);
+  REQUIRE(calculator::calculate("long_ascii_prefix_€_and_suffix_abcdefgh*2", v1).asInt() == 4);
+  REQUIRE(calculator::calculate("                          1 +                    2").asInt() == 3);
+  REQUIRE(calculator::calculate("\t\t\t\t\t\t\t\t\t1\r\n+\v\f2").asInt() == 3);
+
+  // Malformed UTF8 characters inside variable names:
+  REQUIRE_THROWS(calculator::calculate("abcdefghijklmnop\xC0\xAF", v1));
+  REQUIRE_THROWS(calculator::calculate("abc\xED\xA0\x80", v1));
+
+  // Whitespace delimiters should stop long runs of spaces:
+  const char* code = "1 +                2          \n 3";
+  REQUIRE(calculator::calculate(code, v1, "\n", &code).asInt() == 3);
+  REQUIRE(*code == '\n');
+
+  charSet_t delims(";\n");
+  REQUIRE(delims.has(';'));
+  REQUIRE(delims.has('\n'));
+  REQUIRE(delims.has('\0'));
+  REQUIRE_FALSE(delims.has(' '));
+  REQUIRE_FALSE(delims.has('\xFF'));
+  REQUIRE(delims.spaces);
+}
+
 // UTF8 tests are based off of: https://www.cl.cam.ac.uk/~mgk25/ucs/examples/UTF-8-test.txt
 TEST_CASE("mgk25 UTF8") {
     auto testutf8str = [](const char* str) {